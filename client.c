@@ -23,7 +23,16 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    char command[BUFFER_SIZE] = "";
+    size_t commandLength = 1;
+    for (int i = 3; i < argc; i++) {
+        commandLength += strlen(argv[i]) + 1;
+    }
+
+    char *command = calloc(commandLength, 1);
+    if (command == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
     for (int i = 3; i < argc; i++) {
         strcat(command, argv[i]);
         if (i < argc - 1) {
@@ -60,20 +69,25 @@ int main(int argc, char **argv) {
 
     if (send(sock, command, strlen(command), 0) < 0) {
         fprintf(stderr, "Failed to send command\n");
+        free(command);
         close(sock);
         return 1;
     }
+    free(command);
+
+    shutdown(sock, SHUT_WR);
 
-    char buffer[BUFFER_SIZE] = {0};
-    int valread = read(sock, buffer, BUFFER_SIZE);
+    char buffer[BUFFER_SIZE];
+    ssize_t valread;
+    while ((valread = read(sock, buffer, BUFFER_SIZE)) > 0) {
+        fwrite(buffer, 1, valread, stdout);
+    }
     if (valread < 0) {
         fprintf(stderr, "Failed to receive response\n");
         close(sock);
         return 1;
     }
 
-    printf("%s", buffer);
-
     close(sock);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,719 @@
+// Differential tester for the rule parser and matcher. Random rule sets and
+// checks are run through the server's own code (the reference) and through
+// an independent engine built on packed numeric ranges, and the first
+// disagreement is reported together with a command script that reproduces
+// it under ./server -i.
+//
+// Usage: ./difftest [seed] [rounds]
+//
+// To validate a rewritten matcher, add it to the engines table below.
+
+#include <fcntl.h>
+#include <time.h>
+
+#define SERVER_NO_MAIN
+#include "server.c"
+
+#define OPS_PER_ROUND 200
+#define MAX_OP_LENGTH 512
+
+typedef enum {
+    OP_ADD,
+    OP_DELETE,
+    OP_CHECK
+} OpType;
+
+typedef struct {
+    OpType type;
+    char text[MAX_OP_LENGTH];
+    IPAddress ip;
+    unsigned short port;
+} Op;
+
+// Outcome of one operation: whether an add or delete succeeded, or for a
+// check the list position of the rule it was accepted by (-1 if rejected).
+typedef struct {
+    bool ok;
+    bool secondDelete;
+    long matched;
+} OpResult;
+
+typedef struct {
+    const char* name;
+    void* (*create)(void);
+    OpResult (*apply)(void* engine, const Op* op);
+    void (*destroy)(void* engine);
+} Engine;
+
+static int devnull = -1;
+
+// --- reference engine: the server's own functions ---
+
+typedef struct {
+    RuleSet rules;
+    Response out;
+} ReferenceEngine;
+
+void* referenceCreate(void) {
+    ReferenceEngine* engine = malloc(sizeof(ReferenceEngine));
+    InitRuleSet(&engine->rules);
+    InitResponse(&engine->out, devnull);
+    return engine;
+}
+
+OpResult referenceApply(void* arg, const Op* op) {
+    ReferenceEngine* engine = arg;
+    OpResult result = {false, false, -1};
+    char command[MAX_OP_LENGTH];
+    strcpy(command, op->text);
+
+    if (op->type == OP_ADD) {
+        long before = engine->rules.count;
+        AddRule(command, &engine->rules, &engine->out);
+        result.ok = engine->rules.count > before;
+    } else if (op->type == OP_DELETE) {
+        bool isValid = true;
+        Rule* ruleToDelete = parseRule(command, &isValid);
+        result.ok = deleteRule(&engine->rules, ruleToDelete, &engine->out);
+        result.secondDelete = deleteRule(&engine->rules, ruleToDelete, &engine->out);
+        FreeRule(ruleToDelete);
+    } else {
+        Rule* matched = isConnectionAllowed(&engine->rules, op->ip, op->port);
+        if (matched != NULL) {
+            result.ok = true;
+            result.matched = 0;
+            while (engine->rules.rules[result.matched] != matched) {
+                result.matched++;
+            }
+        }
+    }
+
+    FlushResponse(&engine->out);
+    return result;
+}
+
+void referenceDestroy(void* arg) {
+    ReferenceEngine* engine = arg;
+    FreeRuleSet(&engine->rules);
+    FreeResponse(&engine->out);
+    free(engine);
+}
+
+// --- packed engine: an independent parser over numeric ranges ---
+
+typedef struct {
+    unsigned int address;
+    unsigned short port;
+} Flow;
+
+typedef struct {
+    unsigned int ipStart;
+    unsigned int ipEnd;
+    int ipIsRange;
+    unsigned short portStart;
+    unsigned short portEnd;
+    int portIsRange;
+    int spanCount;
+    PortSpan* spans;
+    Flow* seen;
+    int seenCount;
+    int seenCap;
+} PackedRule;
+
+typedef struct {
+    PackedRule* rules;
+    int count;
+    int cap;
+} PackedEngine;
+
+bool packedParseAddress(const char* str, const char* end, unsigned int* address) {
+    unsigned int value = 0;
+    for (int i = 0; i < 4; i++) {
+        int num = 0;
+        int digits = 0;
+        while (str < end && isdigit((unsigned char)*str) && digits < 3) {
+            num = num * 10 + (*str++ - '0');
+            digits++;
+        }
+        if (digits == 0 || num > 255) {
+            return false;
+        }
+        value = (value << 8) | num;
+        if (i < 3 && (str >= end || *str++ != '.')) {
+            return false;
+        }
+    }
+    *address = value;
+    return str == end;
+}
+
+bool packedParseIP(const char* str, PackedRule* rule) {
+    const char* end = str + strlen(str);
+    const char* dash = strchr(str, '-');
+    const char* slash = strchr(str, '/');
+    const char* star = strchr(str, '*');
+
+    if (star != NULL) {
+        if (strcmp(str, "*") == 0) {
+            rule->ipStart = 0;
+            rule->ipEnd = 0xFFFFFFFFu;
+            rule->ipIsRange = 1;
+            return true;
+        }
+        // Replace trailing "*" octets with 0 and widen the mask to match.
+        char buffer[32];
+        int stars = 0;
+        if (end - str >= (long)sizeof(buffer)) {
+            return false;
+        }
+        strcpy(buffer, str);
+        for (char* p = buffer + strlen(buffer) - 1; p >= buffer && stars < 4; ) {
+            if (*p != '*' || (p > buffer && p[-1] != '.')) {
+                break;
+            }
+            *p = '0';
+            stars++;
+            p -= 2;
+        }
+        if (strchr(buffer, '*') != NULL ||
+            !packedParseAddress(buffer, buffer + strlen(buffer), &rule->ipStart)) {
+            return false;
+        }
+        unsigned int mask = stars == 4 ? 0 : 0xFFFFFFFFu << (8 * stars);
+        rule->ipEnd = rule->ipStart | ~mask;
+        rule->ipIsRange = 1;
+        return true;
+    }
+
+    if (slash != NULL) {
+        int prefix = 0;
+        int digits = 0;
+        for (const char* p = slash + 1; p < end; p++) {
+            if (!isdigit((unsigned char)*p)) {
+                return false;
+            }
+            prefix = prefix * 10 + (*p - '0');
+            digits++;
+        }
+        if (digits == 0 || digits > 2 || prefix > 32 ||
+            !packedParseAddress(str, slash, &rule->ipStart)) {
+            return false;
+        }
+        unsigned int mask = prefix == 0 ? 0 : 0xFFFFFFFFu << (32 - prefix);
+        rule->ipStart &= mask;
+        rule->ipEnd = rule->ipStart | ~mask;
+        rule->ipIsRange = prefix < 32;
+        return true;
+    }
+
+    if (dash != NULL) {
+        rule->ipIsRange = 1;
+        return packedParseAddress(str, dash, &rule->ipStart) &&
+               packedParseAddress(dash + 1, end, &rule->ipEnd);
+    }
+
+    rule->ipIsRange = 0;
+    if (!packedParseAddress(str, end, &rule->ipStart)) {
+        return false;
+    }
+    rule->ipEnd = rule->ipStart;
+    return true;
+}
+
+bool packedParsePortNumber(const char* str, const char* end, unsigned short* port) {
+    long value = 0;
+    if (str == end || end - str > 5) {
+        return false;
+    }
+    for (; str < end; str++) {
+        if (!isdigit((unsigned char)*str)) {
+            return false;
+        }
+        value = value * 10 + (*str - '0');
+    }
+    if (value < 1 || value > 65535) {
+        return false;
+    }
+    *port = value;
+    return true;
+}
+
+bool packedParsePortSpan(const char* str, const char* end, PortSpan* span, bool* isRange) {
+    const char* dash = memchr(str, '-', end - str);
+    if (dash == NULL) {
+        *isRange = false;
+        if (!packedParsePortNumber(str, end, &span->start)) {
+            return false;
+        }
+        span->end = span->start;
+        return true;
+    }
+    *isRange = true;
+    return packedParsePortNumber(str, dash, &span->start) &&
+           packedParsePortNumber(dash + 1, end, &span->end) &&
+           span->start <= span->end;
+}
+
+int compareSpans(const void* a, const void* b) {
+    return (int)((const PortSpan*)a)->start - (int)((const PortSpan*)b)->start;
+}
+
+bool packedParsePorts(const char* str, PackedRule* rule) {
+    // A list has at most one span per comma-separated item.
+    int items = 1;
+    for (const char* p = str; *p; p++) {
+        items += *p == ',';
+    }
+    rule->spans = malloc(items * sizeof(PortSpan));
+
+    if (strcmp(str, "*") == 0) {
+        rule->spanCount = 1;
+        rule->spans[0].start = 1;
+        rule->spans[0].end = 65535;
+        rule->portIsRange = 1;
+    } else if (strchr(str, ',') == NULL) {
+        bool isRange;
+        if (!packedParsePortSpan(str, str + strlen(str), &rule->spans[0], &isRange)) {
+            return false;
+        }
+        rule->spanCount = 1;
+        rule->portIsRange = isRange;
+    } else {
+        rule->spanCount = 0;
+        const char* p = str;
+        while (1) {
+            const char* comma = strchr(p, ',');
+            const char* itemEnd = comma ? comma : p + strlen(p);
+            bool isRange;
+            if (!packedParsePortSpan(p, itemEnd, &rule->spans[rule->spanCount], &isRange)) {
+                return false;
+            }
+            rule->spanCount++;
+            if (comma == NULL) {
+                break;
+            }
+            p = comma + 1;
+        }
+
+        qsort(rule->spans, rule->spanCount, sizeof(PortSpan), compareSpans);
+        int merged = 0;
+        for (int i = 1; i < rule->spanCount; i++) {
+            if (rule->spans[i].start <= rule->spans[merged].end + 1) {
+                if (rule->spans[i].end > rule->spans[merged].end) {
+                    rule->spans[merged].end = rule->spans[i].end;
+                }
+            } else {
+                rule->spans[++merged] = rule->spans[i];
+            }
+        }
+        rule->spanCount = merged + 1;
+        rule->portIsRange = rule->spans[0].start != rule->spans[merged].end;
+    }
+
+    rule->portStart = rule->spans[0].start;
+    rule->portEnd = rule->spans[rule->spanCount - 1].end;
+    return true;
+}
+
+// On success the rule owns its spans array.
+bool packedParseRule(const char* text, PackedRule* rule) {
+    char copy[MAX_OP_LENGTH];
+    memset(rule, 0, sizeof(PackedRule));
+    snprintf(copy, sizeof(copy), "%s", text + 1);
+
+    char* ip_str = strtok(copy, " \t");
+    char* port_str = ip_str ? strtok(NULL, " \t") : NULL;
+    if (port_str == NULL) {
+        return false;
+    }
+    if (!packedParseIP(ip_str, rule) || !packedParsePorts(port_str, rule)) {
+        free(rule->spans);
+        return false;
+    }
+    return true;
+}
+
+bool packedRulesEqual(const PackedRule* a, const PackedRule* b) {
+    return a->ipStart == b->ipStart && a->ipEnd == b->ipEnd &&
+           a->ipIsRange == b->ipIsRange &&
+           a->portStart == b->portStart && a->portEnd == b->portEnd &&
+           a->portIsRange == b->portIsRange &&
+           a->spanCount == b->spanCount &&
+           memcmp(a->spans, b->spans, a->spanCount * sizeof(PortSpan)) == 0;
+}
+
+bool packedRuleMatches(const PackedRule* rule, unsigned int address, unsigned short port) {
+    if (address < rule->ipStart || address > rule->ipEnd) {
+        return false;
+    }
+    for (int i = 0; i < rule->spanCount; i++) {
+        if (port >= rule->spans[i].start && port <= rule->spans[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool packedDeleteFirst(PackedEngine* engine, const PackedRule* rule) {
+    for (int i = 0; i < engine->count; i++) {
+        if (packedRulesEqual(&engine->rules[i], rule)) {
+            free(engine->rules[i].seen);
+            free(engine->rules[i].spans);
+            memmove(&engine->rules[i], &engine->rules[i + 1],
+                    (engine->count - i - 1) * sizeof(PackedRule));
+            engine->count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void* packedCreate(void) {
+    return calloc(1, sizeof(PackedEngine));
+}
+
+OpResult packedApply(void* arg, const Op* op) {
+    PackedEngine* engine = arg;
+    OpResult result = {false, false, -1};
+    PackedRule rule;
+
+    if (op->type == OP_ADD) {
+        if (!packedParseRule(op->text, &rule)) {
+            return result;
+        }
+        if (engine->count == engine->cap) {
+            engine->cap = engine->cap == 0 ? 16 : engine->cap * 2;
+            engine->rules = realloc(engine->rules, engine->cap * sizeof(PackedRule));
+        }
+        engine->rules[engine->count++] = rule;
+        result.ok = true;
+    } else if (op->type == OP_DELETE) {
+        if (packedParseRule(op->text, &rule)) {
+            result.ok = packedDeleteFirst(engine, &rule);
+            result.secondDelete = packedDeleteFirst(engine, &rule);
+            free(rule.spans);
+        }
+    } else {
+        // A flow is accepted by the first matching rule, as long as some
+        // matching rule has not seen it yet; that rule records it.
+        unsigned int address = ipToUInt(op->ip);
+        long first = -1;
+        for (int i = 0; i < engine->count; i++) {
+            PackedRule* current = &engine->rules[i];
+            if (!packedRuleMatches(current, address, op->port)) {
+                continue;
+            }
+            if (first < 0) {
+                first = i;
+            }
+            bool seen = false;
+            for (int j = 0; j < current->seenCount && !seen; j++) {
+                seen = current->seen[j].address == address && current->seen[j].port == op->port;
+            }
+            if (!seen) {
+                if (current->seenCount == current->seenCap) {
+                    current->seenCap = current->seenCap == 0 ? 4 : current->seenCap * 2;
+                    current->seen = realloc(current->seen, current->seenCap * sizeof(Flow));
+                }
+                current->seen[current->seenCount].address = address;
+                current->seen[current->seenCount].port = op->port;
+                current->seenCount++;
+                result.ok = true;
+                result.matched = first;
+                break;
+            }
+        }
+    }
+
+    return result;
+}
+
+void packedDestroy(void* arg) {
+    PackedEngine* engine = arg;
+    for (int i = 0; i < engine->count; i++) {
+        free(engine->rules[i].seen);
+        free(engine->rules[i].spans);
+    }
+    free(engine->rules);
+    free(engine);
+}
+
+Engine engines[] = {
+    {"reference", referenceCreate, referenceApply, referenceDestroy},
+    {"packed", packedCreate, packedApply, packedDestroy},
+};
+
+// --- random workload ---
+
+// Addresses are drawn from a few small neighbourhoods so that rules overlap
+// and checks hit range boundaries.
+IPAddress randomIP(void) {
+    static const unsigned char bases[][2] = {{10, 0}, {10, 1}, {192, 168}, {172, 16}};
+    IPAddress ip;
+    int base = rand() % 4;
+    ip.octet[0] = bases[base][0];
+    ip.octet[1] = bases[base][1];
+    ip.octet[2] = rand() % 3;
+    ip.octet[3] = rand() % 4 == 0 ? 255 : rand() % 40;
+    if (rand() % 20 == 0) {
+        ip.octet[0] = rand() % 256;
+        ip.octet[1] = rand() % 256;
+    }
+    return ip;
+}
+
+unsigned short randomPort(void) {
+    switch (rand() % 8) {
+        case 0: return 1;
+        case 1: return 65535;
+        default: return 20 + rand() % 70;
+    }
+}
+
+int formatIP(char* buffer, size_t size, IPAddress ip) {
+    return snprintf(buffer, size, "%d.%d.%d.%d", ip.octet[0], ip.octet[1], ip.octet[2], ip.octet[3]);
+}
+
+void randomIPText(char* buffer, size_t size) {
+    static const char* invalid[] = {
+        "256.1.1.1", "1.2.3", "10.0.0.0/33", "10.*.0.1", "1.2.3.4-", "10.0.0.0/", "**",
+    };
+    IPAddress ip = randomIP();
+    IPAddress other = randomIP();
+    int len;
+
+    switch (rand() % 10) {
+        case 0:
+        case 1:
+        case 2:
+            formatIP(buffer, size, ip);
+            break;
+        case 3:
+        case 4:
+            // Same neighbourhood, so that most ranges are ordered.
+            other.octet[0] = ip.octet[0];
+            other.octet[1] = ip.octet[1];
+            if (rand() % 8 != 0 && memcmp(&other, &ip, sizeof(IPAddress)) < 0) {
+                IPAddress swap = ip;
+                ip = other;
+                other = swap;
+            }
+            len = formatIP(buffer, size, ip);
+            buffer[len++] = '-';
+            formatIP(buffer + len, size - len, other);
+            break;
+        case 5:
+        case 6:
+            len = formatIP(buffer, size, ip);
+            snprintf(buffer + len, size - len, "/%d", 8 + rand() % 25);
+            break;
+        case 7: {
+            int stars = 1 + rand() % 3;
+            len = 0;
+            for (int i = 0; i < 4; i++) {
+                len += snprintf(buffer + len, size - len, i < 4 - stars ? "%d" : "*", ip.octet[i]);
+                if (i < 3) {
+                    buffer[len++] = '.';
+                }
+            }
+            break;
+        }
+        case 8:
+            snprintf(buffer, size, "*");
+            break;
+        default:
+            snprintf(buffer, size, "%s", invalid[rand() % (sizeof(invalid) / sizeof(invalid[0]))]);
+            break;
+    }
+}
+
+void randomPortText(char* buffer, size_t size) {
+    static const char* invalid[] = {"0", "65536", "80,", ",80", "90-80", "1-0", "x"};
+    unsigned short port = randomPort();
+    int len;
+
+    switch (rand() % 8) {
+        case 0:
+        case 1:
+        case 2:
+            snprintf(buffer, size, "%d", port);
+            break;
+        case 3:
+        case 4:
+            snprintf(buffer, size, "%d-%d", port, port + rand() % 20);
+            break;
+        case 5: {
+            // Mostly short lists, sometimes long enough to need many spans.
+            int items = rand() % 4 == 0 ? 17 + rand() % 24 : 2 + rand() % 4;
+            len = 0;
+            for (int i = 0; i < items; i++) {
+                unsigned short item = randomPort();
+                if (rand() % 3 == 0 && item < 65000) {
+                    len += snprintf(buffer + len, size - len, "%s%d-%d", i ? "," : "", item, item + rand() % 10);
+                } else {
+                    len += snprintf(buffer + len, size - len, "%s%d", i ? "," : "", item);
+                }
+            }
+            break;
+        }
+        case 6:
+            snprintf(buffer, size, "*");
+            break;
+        default:
+            snprintf(buffer, size, "%s", invalid[rand() % (sizeof(invalid) / sizeof(invalid[0]))]);
+            break;
+    }
+}
+
+void insertChar(char* buffer, size_t at, char c) {
+    memmove(buffer + at + 1, buffer + at, strlen(buffer + at) + 1);
+    buffer[at] = c;
+}
+
+// Picks a random position where a run of digits starts, or -1 if there is
+// none.
+long randomDigitRun(const char* buffer) {
+    long candidates[MAX_OP_LENGTH];
+    long count = 0;
+    for (long i = 0; buffer[i]; i++) {
+        if (isdigit((unsigned char)buffer[i]) && (i == 0 || !isdigit((unsigned char)buffer[i - 1]))) {
+            candidates[count++] = i;
+        }
+    }
+    return count == 0 ? -1 : candidates[rand() % count];
+}
+
+// Perturbs generated text the way hand-typed rules go wrong: trailing junk,
+// leading zeros, signs and stray whitespace. Both engines must agree on
+// whether the result is accepted.
+void mutateText(char* buffer, size_t size) {
+    static const char junk[] = "x.-,/*+0 \t";
+    size_t len = strlen(buffer);
+    long at;
+
+    if (len + 2 > size) {
+        return;
+    }
+
+    switch (rand() % 4) {
+        case 0:
+            insertChar(buffer, len, junk[rand() % (sizeof(junk) - 1)]);
+            break;
+        case 1:
+            at = randomDigitRun(buffer);
+            insertChar(buffer, at < 0 ? len : (size_t)at, '0');
+            break;
+        case 2:
+            at = randomDigitRun(buffer);
+            insertChar(buffer, at < 0 ? 0 : (size_t)at, rand() % 2 ? '+' : '-');
+            break;
+        default:
+            insertChar(buffer, rand() % (len + 1), rand() % 2 ? ' ' : '\t');
+            break;
+    }
+}
+
+void randomRuleText(char* ip_str, size_t ipSize, char* port_str, size_t portSize) {
+    randomIPText(ip_str, ipSize);
+    randomPortText(port_str, portSize);
+    if (rand() % 6 == 0) {
+        mutateText(ip_str, ipSize);
+    }
+    if (rand() % 6 == 0) {
+        mutateText(port_str, portSize);
+    }
+}
+
+void randomOp(Op* op, Op* history, int count) {
+    char ip_str[64];
+    char port_str[320];
+    int kind = rand() % 10;
+
+    if (kind < 4) {
+        op->type = OP_ADD;
+        randomRuleText(ip_str, sizeof(ip_str), port_str, sizeof(port_str));
+        snprintf(op->text, sizeof(op->text), "A %s %s", ip_str, port_str);
+    } else if (kind < 5) {
+        op->type = OP_DELETE;
+        Op* previous = count > 0 ? &history[rand() % count] : NULL;
+        if (previous != NULL && previous->type == OP_ADD && rand() % 2 == 0) {
+            snprintf(op->text, sizeof(op->text), "D%s", previous->text + 1);
+        } else {
+            randomRuleText(ip_str, sizeof(ip_str), port_str, sizeof(port_str));
+            snprintf(op->text, sizeof(op->text), "D %s %s", ip_str, port_str);
+        }
+    } else {
+        op->type = OP_CHECK;
+        op->ip = randomIP();
+        op->port = randomPort();
+        int len = snprintf(op->text, sizeof(op->text), "C ");
+        len += formatIP(op->text + len, sizeof(op->text) - len, op->ip);
+        snprintf(op->text + len, sizeof(op->text) - len, " %d", op->port);
+    }
+}
+
+bool resultsEqual(OpResult a, OpResult b) {
+    return a.ok == b.ok && a.secondDelete == b.secondDelete && a.matched == b.matched;
+}
+
+void printResult(const char* name, OpResult result) {
+    fprintf(stderr, "  %-10s ok=%d second=%d matched=%ld\n",
+            name, result.ok, result.secondDelete, result.matched);
+}
+
+// Runs one round of random operations through every engine. Returns false
+// and prints a reproduction script on the first divergence.
+bool runRound(unsigned int seed, long round) {
+    int engineCount = sizeof(engines) / sizeof(engines[0]);
+    void* states[sizeof(engines) / sizeof(engines[0])];
+    Op history[OPS_PER_ROUND];
+    bool agreed = true;
+
+    for (int e = 0; e < engineCount; e++) {
+        states[e] = engines[e].create();
+    }
+
+    for (int i = 0; i < OPS_PER_ROUND && agreed; i++) {
+        Op* op = &history[i];
+        randomOp(op, history, i);
+
+        OpResult expected = engines[0].apply(states[0], op);
+        for (int e = 1; e < engineCount; e++) {
+            OpResult actual = engines[e].apply(states[e], op);
+            if (!resultsEqual(expected, actual)) {
+                fprintf(stderr, "divergence: seed %u round %ld step %d: %s\n",
+                        seed, round, i, op->text);
+                printResult(engines[0].name, expected);
+                printResult(engines[e].name, actual);
+                fprintf(stderr, "commands so far:\n");
+                for (int j = 0; j <= i; j++) {
+                    fprintf(stderr, "%s\n", history[j].text);
+                }
+                agreed = false;
+                break;
+            }
+        }
+    }
+
+    for (int e = 0; e < engineCount; e++) {
+        engines[e].destroy(states[e]);
+    }
+    return agreed;
+}
+
+int main(int argc, char** argv) {
+    unsigned int seed = argc > 1 ? strtoul(argv[1], NULL, 10) : (unsigned int)time(NULL);
+    long rounds = argc > 2 ? strtol(argv[2], NULL, 10) : 1000;
+
+    devnull = open("/dev/null", O_WRONLY);
+    srand(seed);
+
+    for (long round = 0; round < rounds; round++) {
+        if (!runRound(seed, round)) {
+            return 1;
+        }
+    }
+
+    printf("%ld rounds of %d operations agreed (seed %u)\n", rounds, OPS_PER_ROUND, seed);
+    return 0;
+}
@@ -0,0 +1,66 @@
+// Fuzz harness for the rule parser and matcher. Each input is run as a
+// batch of interactive commands against a fresh rule list.
+//
+// libFuzzer:  make fuzz && ./fuzz
+// AFL:        make fuzz-standalone CC=afl-clang-fast
+//             afl-fuzz -i <seed dir> -o findings ./fuzz-standalone
+
+#include <fcntl.h>
+#include <stdint.h>
+
+#define SERVER_NO_MAIN
+#include "server.c"
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static int devnull = -1;
+    if (devnull < 0) {
+        devnull = open("/dev/null", O_WRONLY);
+    }
+
+    RequestLog requests;
+    RuleSet rules;
+
+    InitRequestLog(&requests);
+    InitRuleSet(&rules);
+
+    Response out;
+    InitResponse(&out, devnull);
+
+    char* line = NULL;
+    size_t lineCap = 0;
+    bool quit = false;
+
+    ProcessCommandBuffer((const char*)data, size, true, &line, &lineCap, &quit,
+                         &requests, &rules, &out, NULL);
+    FlushResponse(&out);
+
+    FreeResponse(&out);
+    free(line);
+    FreeRequestLog(&requests);
+    FreeRuleSet(&rules);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(void) {
+    size_t cap = INPUT_CHUNK_SIZE;
+    size_t len = 0;
+    char* data = malloc(cap);
+    ssize_t n;
+
+    while (data != NULL && (n = read(STDIN_FILENO, data + len, cap - len)) > 0) {
+        len += n;
+        if (len == cap) {
+            cap *= 2;
+            data = realloc(data, cap);
+        }
+    }
+    if (data == NULL) {
+        return 1;
+    }
+
+    LLVMFuzzerTestOneInput((const uint8_t*)data, len);
+    free(data);
+    return 0;
+}
+#endif
@@ -2,12 +2,57 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
 #include <ctype.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+#define INPUT_CHUNK_SIZE (64 * 1024)
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define RESPONSE_BLOCK_SIZE 4096
+
+#define MAX_CONNECTIONS 128
+#define LISTEN_BACKLOG 64
+#define COMMAND_RATE 200.0
+#define COMMAND_BURST 400.0
+#define CLIENT_TABLE_BITS 10
+#define CLIENT_TABLE_SIZE (1 << CLIENT_TABLE_BITS)
+#define CLIENT_PROBE_LIMIT 16
+#define MAX_CONNECTIONS_PER_CLIENT 8
+#define CLIENT_TIMEOUT_SECONDS 30
+#define MAX_CLIENT_LINE (1 << 20)
+#define PARTIAL_LINE_WAIT_MS 500
+
+// Query history retention. A flow's record is dropped once it has not been
+// checked for QUERY_TTL_SECONDS (0 keeps records forever). Each rule keeps
+// at most MAX_QUERIES_PER_RULE records and all rules together at most
+// MAX_QUERY_RECORDS; past either limit a record that has not been checked
+// recently is dropped to make room.
+#ifndef QUERY_TTL_SECONDS
+#define QUERY_TTL_SECONDS 3600
+#endif
+#ifndef MAX_QUERIES_PER_RULE
+#define MAX_QUERIES_PER_RULE 4096
+#endif
+#ifndef MAX_QUERY_RECORDS
+#define MAX_QUERY_RECORDS (1 << 20)
+#endif
+#define QUERY_REAP_INTERVAL_SECONDS 1
+#define QUERY_REAP_BATCH 64
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 typedef struct {
     bool isInteractive;
@@ -45,64 +90,326 @@ typedef struct {
     int isRange;
 } IPRange;
 
+typedef struct {
+    unsigned short start;
+    unsigned short end;
+} PortSpan;
+
+// A port, port range or port list. start and end always bound the whole
+// set; a list such as 22,80,443 is kept as sorted, merged spans so one
+// source rule stays one rule. Only lists own a spans array, allocated to
+// fit; plain ports and ranges leave it NULL.
 typedef struct {
     unsigned short start;
     unsigned short end;
     int isRange;
+    int spanCount;
+    PortSpan* spans;
 } PortRange;
 
-typedef struct query {
-    IPAddress ipAddress;
+// One record per distinct flow a rule has accepted. Repeat checks of the
+// flow bump hits and lastSeen and set referenced rather than adding
+// records. hits is 0 only in a removed slot awaiting compaction.
+typedef struct {
+    unsigned int address;
     unsigned short port;
-    struct rule* matchedRule;
-    struct query* next;
+    unsigned char referenced;
+    unsigned int lastSeen;
+    unsigned int hits;
 } Query;
 
+// A rule's query history. records holds the flows in first-seen order,
+// including removed slots; index is an open-addressed table of positions
+// in records keyed by flow, with -1 marking an empty slot. Eviction runs a
+// clock hand over records, giving a record checked since the hand last
+// passed it a second chance.
+typedef struct {
+    Query* records;
+    int count;
+    int live;
+    int cap;
+    int* index;
+    int indexSize;
+    int hand;
+} QueryTable;
+
 typedef struct rule{
+    long id;
     IPRange ipRange;
     PortRange portRange;
     int isAllow;
-    struct rule * next;
-    struct query* queries;
+    QueryTable queries;
 } Rule;
 
+// Rules in the order they were added. Ids increase in that order and are
+// never reused, so an id stays a valid place to resume a listing or a
+// sweep while rules are added and deleted, and is found by binary search.
+// queryCount is the number of live query records across all rules, and
+// evictCursor the rule id global eviction resumes from.
+typedef struct {
+    Rule** rules;
+    long count;
+    long cap;
+    long nextId;
+    long queryCount;
+    long evictCursor;
+} RuleSet;
+
+// Every command received, oldest first. Entries are never removed, so a
+// position is a stable cursor. The log starts with an empty entry, which
+// R prints as a blank first line.
+typedef struct {
+    char** commands;
+    long count;
+    long cap;
+} RequestLog;
+
+// Output for one or more commands, kept as a list of iovecs and written
+// with writev. Literal strings and request text are referenced in place;
+// formatted fragments live in fixed blocks so their addresses stay valid
+// until the next flush.
+typedef struct responseBlock {
+    struct responseBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ResponseBlock;
+
+typedef struct {
+    int fd;
+    struct iovec* iov;
+    int count;
+    int cap;
+    size_t pending;
+    ResponseBlock* blocks;
+    ResponseBlock* current;
+    bool failed;
+} Response;
+
+// A page of an L or R listing: up to limit entries starting at cursor,
+// which is a rule id for L and a log position for R. Entries at or past
+// end are left out. L pages can be restricted to rules overlapping ipRange
+// and portRange.
+typedef struct {
+    long cursor;
+    long limit;
+    long end;
+    bool hasIPFilter;
+    IPRange ipRange;
+    bool hasPortFilter;
+    PortRange portRange;
+} ListPage;
+
+// An L or R listing in progress. Listings are built in parts of about
+// OUTPUT_BUFFER_SIZE, and the state lock is dropped while each part is
+// written. Rule ids and log positions are stable, so the next part resumes
+// where the last one stopped.
+typedef struct {
+    bool active;
+    bool isRules;
+    ListPage page;
+} Listing;
 
-typedef struct request{
-    char command[256];
-    struct request * next;
-} Request;
+// Per-client-address state: a command budget refilled at COMMAND_RATE per
+// second up to COMMAND_BURST, and the number of open connections.
+typedef struct {
+    struct in_addr address;
+    double tokens;
+    struct timespec refilled;
+    int connections;
+    bool used;
+} ClientEntry;
+
+// Exclusive access to the shared lists. Callers waiting with a mutating
+// command are let in ahead of everyone else.
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t released;
+    bool held;
+    int waitingMutators;
+} StateLock;
 
 typedef struct {
     int socket;
-    Request* requests;
-    Rule* rules;
-    Query* queries;
+    struct in_addr address;
+    RequestLog* requests;
+    RuleSet* rules;
 } ThreadArgs;
 
-bool isValidIPNumber(int num) {
-    return (num >= 0 && num <= 255);
+void InitResponse(Response* out, int fd) {
+    out->fd = fd;
+    out->iov = NULL;
+    out->count = 0;
+    out->cap = 0;
+    out->pending = 0;
+    out->blocks = NULL;
+    out->current = NULL;
+    out->failed = false;
 }
 
+void FreeResponse(Response* out) {
+    ResponseBlock* block = out->blocks;
+    while (block != NULL) {
+        ResponseBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(out->iov);
+    InitResponse(out, out->fd);
+}
 
-bool isValidIPAddress(const char* ip_str) {
-    int dotCount = 0;
-    for (const char* p = ip_str; *p; p++) {
-        if (*p == '.') {
-            dotCount++;
+// Writes everything queued so far in as few writev calls as possible.
+// Callers must not hold the state lock, since a slow reader can block here
+// for up to the send timeout.
+bool FlushResponse(Response* out) {
+    struct iovec* iov = out->iov;
+    int count = out->count;
+
+    while (count > 0 && !out->failed) {
+        ssize_t written = writev(out->fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (written < 0) {
+            out->failed = true;
+            break;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
         }
     }
 
-    if (dotCount != 3) {
-        return false;
+    out->count = 0;
+    out->pending = 0;
+    for (ResponseBlock* block = out->blocks; block != NULL; block = block->next) {
+        block->used = 0;
     }
+    out->current = out->blocks;
+    return !out->failed;
+}
 
-    int num1, num2, num3, num4;
-    if (sscanf(ip_str, "%d.%d.%d.%d", &num1, &num2, &num3, &num4) != 4) {
-        return false;
+// True once enough output is queued that it should be sent before more is
+// built.
+bool ResponseFull(Response* out) {
+    return out->pending >= OUTPUT_BUFFER_SIZE || out->count >= IOV_MAX;
+}
+
+// Queues len bytes at data without copying them. The bytes must stay valid
+// until the response is flushed. Nothing is written here; callers flush
+// once they have released the state lock.
+void ResponseAddBytes(Response* out, const char* data, size_t len) {
+    if (len == 0 || out->failed) {
+        return;
     }
 
-    return isValidIPNumber(num1) && isValidIPNumber(num2) && 
-           isValidIPNumber(num3) && isValidIPNumber(num4);
+    struct iovec* last = out->count > 0 ? &out->iov[out->count - 1] : NULL;
+    if (last != NULL && (const char*)last->iov_base + last->iov_len == data) {
+        last->iov_len += len;
+    } else {
+        if (out->count == out->cap) {
+            int cap = out->cap == 0 ? 64 : out->cap * 2;
+            struct iovec* grown = realloc(out->iov, cap * sizeof(struct iovec));
+            if (grown == NULL) {
+                out->failed = true;
+                return;
+            }
+            out->iov = grown;
+            out->cap = cap;
+        }
+        out->iov[out->count].iov_base = (void*)data;
+        out->iov[out->count].iov_len = len;
+        out->count++;
+    }
+    out->pending += len;
+}
+
+void ResponseAddString(Response* out, const char* str) {
+    ResponseAddBytes(out, str, strlen(str));
+}
+
+// Finds room for len bytes in the block list, adding a block if needed.
+char* reserveResponseSpace(Response* out, size_t len) {
+    ResponseBlock* block = out->current;
+    while (block != NULL && block->size - block->used < len) {
+        block = block->next;
+    }
+
+    if (block == NULL) {
+        size_t size = len > RESPONSE_BLOCK_SIZE ? len : RESPONSE_BLOCK_SIZE;
+        block = malloc(sizeof(ResponseBlock) + size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->size = size;
+        block->used = 0;
+        block->next = NULL;
+        if (out->current == NULL) {
+            block->next = out->blocks;
+            out->blocks = block;
+        } else {
+            block->next = out->current->next;
+            out->current->next = block;
+        }
+    }
+
+    out->current = block;
+    return block->data + block->used;
+}
+
+void ResponsePrintf(Response* out, const char* format, ...) {
+    va_list args;
+    char small[128];
+
+    va_start(args, format);
+    int len = vsnprintf(small, sizeof(small), format, args);
+    va_end(args);
+    if (len <= 0 || out->failed) {
+        return;
+    }
+
+    char* dest = reserveResponseSpace(out, len + 1);
+    if (dest == NULL) {
+        out->failed = true;
+        return;
+    }
+    if ((size_t)len < sizeof(small)) {
+        memcpy(dest, small, len);
+    } else {
+        va_start(args, format);
+        vsnprintf(dest, len + 1, format, args);
+        va_end(args);
+    }
+    out->current->used += len;
+    ResponseAddBytes(out, dest, len);
+}
+
+bool isValidIPNumber(int num) {
+    return (num >= 0 && num <= 255);
+}
+
+
+// Accepts exactly four dot-separated octets of one to three digits. Signs,
+// whitespace and trailing characters are rejected.
+bool isValidIPAddress(const char* ip_str) {
+    const char* p = ip_str;
+    for (int i = 0; i < 4; i++) {
+        int num = 0;
+        int digits = 0;
+        while (isdigit((unsigned char)*p) && digits < 3) {
+            num = num * 10 + (*p++ - '0');
+            digits++;
+        }
+        if (digits == 0 || !isValidIPNumber(num)) {
+            return false;
+        }
+        if (i < 3 && *p++ != '.') {
+            return false;
+        }
+    }
+    return *p == '\0';
 }
 
 IPAddress parseIPAddress(const char* ip_str) {
@@ -115,20 +422,137 @@ IPAddress parseIPAddress(const char* ip_str) {
     return ip;
 }
 
+unsigned int ipToUInt(IPAddress ip) {
+    return ((unsigned int)ip.octet[0] << 24) | ((unsigned int)ip.octet[1] << 16) |
+           ((unsigned int)ip.octet[2] << 8) | (unsigned int)ip.octet[3];
+}
+
+IPAddress uintToIP(unsigned int value) {
+    IPAddress ip;
+    ip.octet[0] = (value >> 24) & 0xFF;
+    ip.octet[1] = (value >> 16) & 0xFF;
+    ip.octet[2] = (value >> 8) & 0xFF;
+    ip.octet[3] = value & 0xFF;
+    return ip;
+}
+
 bool isIPInRange(IPAddress ip, IPRange range) {
-    for (int i = 0; i < 4; i++) {
-        if (ip.octet[i] < range.start.octet[i] || ip.octet[i] > range.end.octet[i]) {
-            return false;
+    unsigned int address = ipToUInt(ip);
+    return address >= ipToUInt(range.start) && address <= ipToUInt(range.end);
+}
+
+bool isPortInRange(unsigned short port, const PortRange* range) {
+    if (port < range->start || port > range->end) {
+        return false;
+    }
+    if (range->spans == NULL) {
+        return true;
+    }
+
+    int low = 0;
+    int high = range->spanCount - 1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (port < range->spans[mid].start) {
+            high = mid - 1;
+        } else if (port > range->spans[mid].end) {
+            low = mid + 1;
+        } else {
+            return true;
         }
-        if (ip.octet[i] != range.start.octet[i]) {
-            break;
+    }
+    return false;
+}
+
+// Gives plain ports and ranges the same span view as lists, using single
+// as the storage for their one span.
+const PortSpan* portRangeSpans(const PortRange* range, PortSpan* single) {
+    if (range->spans != NULL) {
+        return range->spans;
+    }
+    single->start = range->start;
+    single->end = range->end;
+    return single;
+}
+
+void FreePortRange(PortRange* range) {
+    free(range->spans);
+    range->spans = NULL;
+}
+
+// Parses a.b.c.d/n into the block of addresses it covers. Host bits in the
+// base address are ignored.
+bool parseCIDR(const char* ip_str, const char* slash, IPRange* range) {
+    char base_ip[16];
+    int len = slash - ip_str;
+    if (len >= (int)sizeof(base_ip)) {
+        return false;
+    }
+    strncpy(base_ip, ip_str, len);
+    base_ip[len] = '\0';
+
+    const char* prefix_str = slash + 1;
+    if (*prefix_str == '\0' || strlen(prefix_str) > 2) {
+        return false;
+    }
+    for (const char* p = prefix_str; *p; p++) {
+        if (!isdigit((unsigned char)*p)) {
+            return false;
         }
     }
+    int prefix = atoi(prefix_str);
+    if (prefix > 32 || !isValidIPAddress(base_ip)) {
+        return false;
+    }
+
+    unsigned int mask = prefix == 0 ? 0 : 0xFFFFFFFFu << (32 - prefix);
+    unsigned int base = ipToUInt(parseIPAddress(base_ip)) & mask;
+    range->start = uintToIP(base);
+    range->end = uintToIP(base | ~mask);
+    range->isRange = prefix < 32;
     return true;
 }
 
-bool isPortInRange(unsigned short port, PortRange range) {
-    return port >= range.start && port <= range.end;
+// Parses *, or an address whose trailing octets are *, such as 10.1.*.*.
+bool parseWildcardIP(const char* ip_str, IPRange* range) {
+    if (strcmp(ip_str, "*") == 0) {
+        memset(&range->start, 0, sizeof(IPAddress));
+        memset(&range->end, 255, sizeof(IPAddress));
+        range->isRange = 1;
+        return true;
+    }
+
+    const char* p = ip_str;
+    bool wildcard = false;
+    for (int i = 0; i < 4; i++) {
+        if (*p == '*') {
+            wildcard = true;
+            range->start.octet[i] = 0;
+            range->end.octet[i] = 255;
+            p++;
+        } else {
+            if (wildcard || !isdigit((unsigned char)*p)) {
+                return false;
+            }
+            int num = 0;
+            int digits = 0;
+            while (isdigit((unsigned char)*p) && digits < 3) {
+                num = num * 10 + (*p++ - '0');
+                digits++;
+            }
+            if (!isValidIPNumber(num)) {
+                return false;
+            }
+            range->start.octet[i] = num;
+            range->end.octet[i] = num;
+        }
+        if (i < 3 && *p++ != '.') {
+            return false;
+        }
+    }
+
+    range->isRange = 1;
+    return *p == '\0';
 }
 
 
@@ -137,11 +561,20 @@ IPRange parseIPRange(const char* ip_str, bool* isValid) {
     IPRange range = {{{0}}, {{0}}, 0}; 
     *isValid = true;
     char* dash = strchr(ip_str, '-');
-    
-    if (dash) {
+    char* slash = strchr(ip_str, '/');
+
+    if (strchr(ip_str, '*')) {
+        *isValid = parseWildcardIP(ip_str, &range);
+    } else if (slash) {
+        *isValid = parseCIDR(ip_str, slash, &range);
+    } else if (dash) {
         char start_ip[16];
         char end_ip[16];
         int len = dash - ip_str;
+        if (len >= (int)sizeof(start_ip) || strlen(dash + 1) >= sizeof(end_ip)) {
+            *isValid = false;
+            return range;
+        }
         strncpy(start_ip, ip_str, len);
         start_ip[len] = '\0';
         strcpy(end_ip, dash + 1);
@@ -168,24 +601,144 @@ IPRange parseIPRange(const char* ip_str, bool* isValid) {
     return range;
 }
 
+int comparePortSpans(const void* a, const void* b) {
+    const PortSpan* span1 = a;
+    const PortSpan* span2 = b;
+    return (int)span1->start - (int)span2->start;
+}
+
+// Sorts and merges a port list's spans, collapsing it to a plain port or
+// range when only one span is left. The array is shrunk to fit.
+void packPortSpans(PortRange* range) {
+    qsort(range->spans, range->spanCount, sizeof(PortSpan), comparePortSpans);
+
+    int merged = 0;
+    for (int i = 1; i < range->spanCount; i++) {
+        if (range->spans[i].start <= range->spans[merged].end + 1) {
+            if (range->spans[i].end > range->spans[merged].end) {
+                range->spans[merged].end = range->spans[i].end;
+            }
+        } else {
+            range->spans[++merged] = range->spans[i];
+        }
+    }
+    range->spanCount = merged + 1;
+
+    range->start = range->spans[0].start;
+    range->end = range->spans[merged].end;
+    range->isRange = range->start != range->end;
+
+    if (range->spanCount == 1) {
+        FreePortRange(range);
+    } else {
+        PortSpan* shrunk = realloc(range->spans, range->spanCount * sizeof(PortSpan));
+        if (shrunk != NULL) {
+            range->spans = shrunk;
+        }
+    }
+}
+
+PortRange parsePortRange(const char* port_str);
+
+PortRange parsePortList(const char* port_str) {
+    PortRange range;
+    int spanCap = 0;
+    range.spanCount = 0;
+    range.spans = NULL;
+    range.isRange = -1;
+
+    const char* p = port_str;
+    while (1) {
+        const char* comma = strchr(p, ',');
+        size_t len = comma ? (size_t)(comma - p) : strlen(p);
+        char item[16];
+
+        if (len == 0 || len >= sizeof(item) || (len == 1 && *p == '*')) {
+            FreePortRange(&range);
+            range.isRange = -1;
+            return range;
+        }
+        memcpy(item, p, len);
+        item[len] = '\0';
+
+        PortRange itemRange = parsePortRange(item);
+        if (itemRange.isRange == -1 || itemRange.spans != NULL ||
+            itemRange.end < itemRange.start) {
+            FreePortRange(&range);
+            range.isRange = -1;
+            return range;
+        }
+        if (range.spanCount == spanCap) {
+            int grownCap = spanCap == 0 ? 4 : spanCap * 2;
+            PortSpan* grown = realloc(range.spans, grownCap * sizeof(PortSpan));
+            if (grown == NULL) {
+                FreePortRange(&range);
+                range.isRange = -1;
+                return range;
+            }
+            range.spans = grown;
+            spanCap = grownCap;
+        }
+        range.spans[range.spanCount].start = itemRange.start;
+        range.spans[range.spanCount].end = itemRange.end;
+        range.spanCount++;
+
+        if (comma == NULL) {
+            break;
+        }
+        p = comma + 1;
+    }
+
+    packPortSpans(&range);
+    return range;
+}
+
+// Accepts a port of one to five digits with nothing around it.
+bool parsePortNumber(const char* port_str, int* port) {
+    size_t len = strlen(port_str);
+    if (len == 0 || len > 5) {
+        return false;
+    }
+    for (const char* p = port_str; *p; p++) {
+        if (!isdigit((unsigned char)*p)) {
+            return false;
+        }
+    }
+    *port = atoi(port_str);
+    return true;
+}
+
 PortRange parsePortRange(const char* port_str) {
     PortRange range;
     char* dash = strchr(port_str, '-');
-    char* endptr;
-    
-    if (dash) {
+
+    range.spanCount = 1;
+    range.spans = NULL;
+
+    if (strcmp(port_str, "*") == 0) {
+        range.start = 1;
+        range.end = 65535;
+        range.isRange = 1;
+    } else if (strchr(port_str, ',')) {
+        return parsePortList(port_str);
+    } else if (dash) {
 
         char start_port[6];
         char end_port[6];
         int len = dash - port_str;
+        if (len >= (int)sizeof(start_port) || strlen(dash + 1) >= sizeof(end_port)) {
+            range.isRange = -1;
+            return range;
+        }
         strncpy(start_port, port_str, len);
         start_port[len] = '\0';
         strcpy(end_port, dash + 1);
 
-        int start_int = strtoul(start_port, &endptr, 10);
-        int end_int = strtoul(end_port, &endptr, 10);
+        int start_int;
+        int end_int;
 
-        if (start_int < 1 || start_int > 65535 || end_int < 1 || end_int > 65535){
+        if (!parsePortNumber(start_port, &start_int) || !parsePortNumber(end_port, &end_int) ||
+            start_int < 1 || start_int > 65535 || end_int < 1 || end_int > 65535){
             range.isRange = -1;
             return range;
         }
@@ -193,9 +746,9 @@ PortRange parsePortRange(const char* port_str) {
         range.end = (unsigned short)end_int;
         range.isRange = 1;
     } else {
-        int port_int = strtoul(port_str, &endptr, 10);
+        int port_int;
 
-        if (port_int < 1 || port_int > 65535){
+        if (!parsePortNumber(port_str, &port_int) || port_int < 1 || port_int > 65535){
             range.isRange = -1;
             return range;
         }
@@ -204,97 +757,521 @@ PortRange parsePortRange(const char* port_str) {
         range.end = range.start;
         range.isRange = 0;
     }
-    
+
     return range;
 }
 
-void AddRequest(Request* head, char command[]) {
-    Request* current = head;
-    while (current->next != NULL) {
-        current = current->next;
+void AddRequest(RequestLog* log, const char* command) {
+    if (log->count == log->cap) {
+        long cap = log->cap == 0 ? 64 : log->cap * 2;
+        char** grown = realloc(log->commands, cap * sizeof(char*));
+        if (grown == NULL) {
+            return;
+        }
+        log->commands = grown;
+        log->cap = cap;
     }
-    current->next = malloc(sizeof(Request));
-    strcpy(current->next->command, command);
-    current->next->next = NULL;
+    char* copy = strdup(command);
+    if (copy != NULL) {
+        log->commands[log->count++] = copy;
+    }
+}
 
+void InitRequestLog(RequestLog* log) {
+    log->commands = NULL;
+    log->count = 0;
+    log->cap = 0;
+    AddRequest(log, "");
 }
 
-void AddQuery(Rule* rule, IPAddress ipAddress, unsigned short port) {
-    Query* newQuery = (Query*)malloc(sizeof(Query));
-    if (newQuery != NULL) {
-        newQuery->ipAddress = ipAddress;
-        newQuery->port = port;
-        newQuery->matchedRule = rule;
-        newQuery->next = rule->queries;
-        rule->queries = newQuery;
+void FreeRequestLog(RequestLog* log) {
+    for (long i = 0; i < log->count; i++) {
+        free(log->commands[i]);
+    }
+    free(log->commands);
+}
+
+void InitRuleSet(RuleSet* set) {
+    set->rules = NULL;
+    set->count = 0;
+    set->cap = 0;
+    set->nextId = 1;
+    set->queryCount = 0;
+    set->evictCursor = 0;
+}
+
+// Returns the index of the first rule whose id is at least id.
+long findRuleIndex(RuleSet* set, long id) {
+    long low = 0;
+    long high = set->count;
+    while (low < high) {
+        long mid = low + (high - low) / 2;
+        if (set->rules[mid]->id < id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+bool appendRule(RuleSet* set, Rule* rule) {
+    if (set->count == set->cap) {
+        long cap = set->cap == 0 ? 16 : set->cap * 2;
+        Rule** grown = realloc(set->rules, cap * sizeof(Rule*));
+        if (grown == NULL) {
+            return false;
+        }
+        set->rules = grown;
+        set->cap = cap;
+    }
+    rule->id = set->nextId++;
+    set->rules[set->count++] = rule;
+    return true;
+}
+
+// Seconds on a monotonic clock, used to age query records.
+unsigned int currentTime() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned int)now.tv_sec;
+}
+
+bool isQueryExpired(Query* query, unsigned int now) {
+    return QUERY_TTL_SECONDS > 0 && now - query->lastSeen >= QUERY_TTL_SECONDS;
+}
+
+unsigned int hashFlow(unsigned int address, unsigned short port) {
+    unsigned int hash = address * 2654435761u ^ port * 2246822519u;
+    return hash ^ (hash >> 15);
+}
+
+void insertQueryIndex(QueryTable* table, int position) {
+    Query* query = &table->records[position];
+    unsigned int mask = table->indexSize - 1;
+    unsigned int slot = hashFlow(query->address, query->port) & mask;
+    while (table->index[slot] >= 0) {
+        slot = (slot + 1) & mask;
+    }
+    table->index[slot] = position;
+}
+
+// Builds an index of indexSize slots (a power of two, more than twice the
+// record capacity) over the live records.
+bool rebuildQueryIndex(QueryTable* table, int indexSize) {
+    int* index = malloc(indexSize * sizeof(int));
+    if (index == NULL) {
+        return false;
+    }
+    memset(index, 0xFF, indexSize * sizeof(int));
+    free(table->index);
+    table->index = index;
+    table->indexSize = indexSize;
+
+    for (int i = 0; i < table->count; i++) {
+        if (table->records[i].hits > 0) {
+            insertQueryIndex(table, i);
+        }
+    }
+    return true;
+}
+
+int queryIndexSizeFor(int cap) {
+    int size = 8;
+    while (size <= cap * 2) {
+        size *= 2;
+    }
+    return size;
+}
+
+void FreeQueries(QueryTable* table) {
+    free(table->records);
+    free(table->index);
+    memset(table, 0, sizeof(QueryTable));
+}
+
+// Squeezes removed slots out of records, keeping first-seen order. With
+// shrink set the arrays are also cut down to fit what is left.
+void compactQueries(QueryTable* table, bool shrink) {
+    if (table->live == 0) {
+        FreeQueries(table);
+        return;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < table->count; i++) {
+        if (table->records[i].hits > 0) {
+            table->records[kept++] = table->records[i];
+        }
+    }
+    table->count = kept;
+    table->hand = 0;
+
+    int indexSize = table->indexSize;
+    if (shrink && table->cap > 2 * kept) {
+        Query* shrunk = realloc(table->records, kept * sizeof(Query));
+        if (shrunk != NULL) {
+            table->records = shrunk;
+            table->cap = kept;
+            indexSize = queryIndexSizeFor(kept);
+        }
+    }
+    if (!rebuildQueryIndex(table, indexSize)) {
+        // Keep the old, larger index; every record is still reachable
+        // once the stale positions are cleared.
+        memset(table->index, 0xFF, table->indexSize * sizeof(int));
+        for (int i = 0; i < table->count; i++) {
+            insertQueryIndex(table, i);
+        }
+    }
+}
+
+void removeQuery(RuleSet* set, QueryTable* table, int position) {
+    table->records[position].hits = 0;
+    table->live--;
+    set->queryCount--;
+}
+
+// Finds the live record of a flow, removing it instead if it has expired.
+Query* findQuery(RuleSet* set, QueryTable* table, IPAddress ipAddress, unsigned short port,
+                 unsigned int now) {
+    if (table->live == 0) {
+        return NULL;
+    }
+
+    unsigned int address = ipToUInt(ipAddress);
+    unsigned int mask = table->indexSize - 1;
+    for (unsigned int slot = hashFlow(address, port) & mask; table->index[slot] >= 0;
+         slot = (slot + 1) & mask) {
+        int position = table->index[slot];
+        Query* query = &table->records[position];
+        if (query->hits > 0 && query->address == address && query->port == port) {
+            if (isQueryExpired(query, now)) {
+                removeQuery(set, table, position);
+                return NULL;
+            }
+            return query;
+        }
+    }
+    return NULL;
+}
+
+// Moves the clock hand to a record not checked since the hand last passed
+// it, clearing referenced marks on the way, and removes that record.
+void evictQuery(RuleSet* set, QueryTable* table) {
+    while (table->live > 0) {
+        if (table->hand >= table->count) {
+            table->hand = 0;
+        }
+        Query* query = &table->records[table->hand];
+        if (query->hits > 0 && !query->referenced) {
+            removeQuery(set, table, table->hand++);
+            return;
+        }
+        query->referenced = 0;
+        table->hand++;
+    }
+}
+
+// Evicts one record to keep within MAX_QUERY_RECORDS, taking rules in turn
+// from a resumable id so the budget is shared round-robin.
+void evictAnyQuery(RuleSet* set) {
+    long i = findRuleIndex(set, set->evictCursor);
+    for (long scanned = 0; scanned < set->count; scanned++, i++) {
+        if (i >= set->count) {
+            i = 0;
+        }
+        Rule* rule = set->rules[i];
+        if (rule->queries.live > 0) {
+            evictQuery(set, &rule->queries);
+            set->evictCursor = rule->id + 1;
+            return;
+        }
     }
 }
 
-bool queryExists(Query* head, IPAddress ipAddress, unsigned short port) {
-    Query* current = head;
-    while (current != NULL) {
-        if (memcmp(&current->ipAddress, &ipAddress, sizeof(IPAddress)) == 0 && current->port == port) {
+void AddQuery(RuleSet* set, Rule* rule, IPAddress ipAddress, unsigned short port, unsigned int now) {
+    QueryTable* table = &rule->queries;
+
+    if (table->live >= MAX_QUERIES_PER_RULE) {
+        evictQuery(set, table);
+    }
+    if (set->queryCount >= MAX_QUERY_RECORDS) {
+        evictAnyQuery(set);
+    }
+
+    // Reuse removed slots before growing.
+    if (table->count == table->cap && table->count > 0 &&
+        table->count - table->live >= table->count / 2) {
+        compactQueries(table, false);
+    }
+    if (table->count == table->cap) {
+        int cap = table->cap == 0 ? 4 : table->cap * 2;
+        Query* grown = realloc(table->records, cap * sizeof(Query));
+        if (grown == NULL) {
+            return;
+        }
+        table->records = grown;
+        table->cap = cap;
+        if (!rebuildQueryIndex(table, queryIndexSizeFor(cap))) {
+            table->cap = table->count;
+            return;
+        }
+    }
+
+    Query* query = &table->records[table->count];
+    query->address = ipToUInt(ipAddress);
+    query->port = port;
+    query->referenced = 0;
+    query->lastSeen = now;
+    query->hits = 1;
+    insertQueryIndex(table, table->count);
+    table->count++;
+    table->live++;
+    set->queryCount++;
+}
+
+// Removes expired records on up to batch rules, starting at the first rule
+// whose id is at least cursor, and compacts tables left mostly empty.
+// Returns the id to resume from, wrapping to 0 at the end.
+long ReapQueries(RuleSet* set, long cursor, int batch, unsigned int now) {
+    long i = findRuleIndex(set, cursor);
+
+    for (int done = 0; done < batch && i < set->count; done++, i++) {
+        QueryTable* table = &set->rules[i]->queries;
+        for (int position = 0; position < table->count; position++) {
+            Query* query = &table->records[position];
+            if (query->hits > 0 && isQueryExpired(query, now)) {
+                removeQuery(set, table, position);
+            }
+        }
+        if (table->count > 0 && table->count - table->live >= table->count / 2) {
+            compactQueries(table, true);
+        }
+    }
+
+    return i < set->count ? set->rules[i]->id : 0;
+}
+
+void PrintRule(Rule* rule, Response* out) {
+    if (rule->ipRange.isRange) {
+        ResponsePrintf(out, "Rule: %d.%d.%d.%d-%d.%d.%d.%d",
+            rule->ipRange.start.octet[0],
+            rule->ipRange.start.octet[1],
+            rule->ipRange.start.octet[2],
+            rule->ipRange.start.octet[3],
+            rule->ipRange.end.octet[0],
+            rule->ipRange.end.octet[1],
+            rule->ipRange.end.octet[2],
+            rule->ipRange.end.octet[3]);
+    } else {
+        ResponsePrintf(out, "Rule: %d.%d.%d.%d",
+            rule->ipRange.start.octet[0],
+            rule->ipRange.start.octet[1],
+            rule->ipRange.start.octet[2],
+            rule->ipRange.start.octet[3]);
+    }
+
+    if (rule->portRange.spans != NULL) {
+        for (int i = 0; i < rule->portRange.spanCount; i++) {
+            PortSpan span = rule->portRange.spans[i];
+            char separator = i == 0 ? ' ' : ',';
+            if (span.start == span.end) {
+                ResponsePrintf(out, "%c%d", separator, span.start);
+            } else {
+                ResponsePrintf(out, "%c%d-%d", separator, span.start, span.end);
+            }
+        }
+        ResponseAddBytes(out, "\n", 1);
+    } else if (rule->portRange.isRange) {
+        ResponsePrintf(out, " %d-%d\n", rule->portRange.start, rule->portRange.end);
+    } else {
+        ResponsePrintf(out, " %d\n", rule->portRange.start);
+    }
+    
+    // Newest first; flows checked more than once show their hit count.
+    unsigned int now = currentTime();
+    for (int i = rule->queries.count - 1; i >= 0; i--) {
+        Query* query = &rule->queries.records[i];
+        if (query->hits == 0 || isQueryExpired(query, now)) {
+            continue;
+        }
+        IPAddress ip = uintToIP(query->address);
+        if (query->hits > 1) {
+            ResponsePrintf(out, "Query: %d.%d.%d.%d %d hits %u\n",
+                ip.octet[0], ip.octet[1], ip.octet[2], ip.octet[3], query->port, query->hits);
+        } else {
+            ResponsePrintf(out, "Query: %d.%d.%d.%d %d\n",
+                ip.octet[0], ip.octet[1], ip.octet[2], ip.octet[3], query->port);
+        }
+    }
+}
+
+// Both span lists are sorted and disjoint, so one merge-style pass finds
+// any port the two ranges share.
+bool portRangesOverlap(const PortRange* range1, const PortRange* range2) {
+    if (range1->start > range2->end || range2->start > range1->end) {
+        return false;
+    }
+
+    PortSpan single1;
+    PortSpan single2;
+    const PortSpan* spans1 = portRangeSpans(range1, &single1);
+    const PortSpan* spans2 = portRangeSpans(range2, &single2);
+    int i = 0;
+    int j = 0;
+    while (i < range1->spanCount && j < range2->spanCount) {
+        if (spans1[i].end < spans2[j].start) {
+            i++;
+        } else if (spans2[j].end < spans1[i].start) {
+            j++;
+        } else {
             return true;
         }
-        current = current->next;
     }
     return false;
 }
 
-void PrintRequests(Request* head) {
-    Request* current = head;
-    while (current != NULL) {
-        printf("%s\n", current->command);
-        current = current->next;
+bool ruleMatchesPage(Rule* rule, ListPage* page) {
+    if (page->hasIPFilter &&
+        (ipToUInt(rule->ipRange.start) > ipToUInt(page->ipRange.end) ||
+         ipToUInt(page->ipRange.start) > ipToUInt(rule->ipRange.end))) {
+        return false;
+    }
+    if (page->hasPortFilter && !portRangesOverlap(&rule->portRange, &page->portRange)) {
+        return false;
     }
+    return true;
 }
 
-void PrintRules(Rule* head) {
-    Rule* current = head;
-    
-    if (current != NULL) {
-        current = current->next;
+// Parses "<cursor> <limit> [<ip-range> [<port-range>]]", tokenising args in
+// place. An ip-range of * leaves addresses unfiltered so a page can be
+// filtered by port alone. A port filter owns spans the caller must free.
+bool parseListPage(char* args, ListPage* page, bool allowFilters) {
+    char* fields[4] = {NULL};
+    int count = 0;
+    char* endptr;
+
+    page->end = LONG_MAX;
+    page->hasIPFilter = false;
+    page->hasPortFilter = false;
+
+    for (char* token = strtok(args, " \t"); token != NULL; token = strtok(NULL, " \t")) {
+        if (count == 4) {
+            return false;
+        }
+        fields[count++] = token;
+    }
+    if (count < 2 || (count > 2 && !allowFilters)) {
+        return false;
     }
 
-    while (current != NULL) {
-        printf("Rule: ");
-        
-        printf("%d.%d.%d.%d", 
-            current->ipRange.start.octet[0],
-            current->ipRange.start.octet[1],
-            current->ipRange.start.octet[2],
-            current->ipRange.start.octet[3]);
-            
-        if (current->ipRange.isRange) {
-            printf("-%d.%d.%d.%d", 
-                current->ipRange.end.octet[0],
-                current->ipRange.end.octet[1],
-                current->ipRange.end.octet[2],
-                current->ipRange.end.octet[3]);
+    page->cursor = strtol(fields[0], &endptr, 10);
+    if (*endptr != '\0' || page->cursor < 0) {
+        return false;
+    }
+    page->limit = strtol(fields[1], &endptr, 10);
+    if (*endptr != '\0' || page->limit <= 0) {
+        return false;
+    }
+
+    if (count >= 3 && strcmp(fields[2], "*") != 0) {
+        bool isValidIP = true;
+        page->ipRange = parseIPRange(fields[2], &isValidIP);
+        if (!isValidIP) {
+            return false;
         }
-        
-        printf(" %d", current->portRange.start);
-        if (current->portRange.isRange) {
-            printf("-%d", current->portRange.end);
+        page->hasIPFilter = true;
+    }
+
+    if (count == 4) {
+        page->portRange = parsePortRange(fields[3]);
+        if (page->portRange.isRange == -1) {
+            return false;
         }
-        printf("\n");
-        
-        Query* queryCurrent = current->queries;
-        while (queryCurrent != NULL) {
-            printf("Query: %d.%d.%d.%d %d\n",
-                queryCurrent->ipAddress.octet[0],
-                queryCurrent->ipAddress.octet[1],
-                queryCurrent->ipAddress.octet[2],
-                queryCurrent->ipAddress.octet[3],
-                queryCurrent->port);
-            queryCurrent = queryCurrent->next;
+        page->hasPortFilter = true;
+    }
+
+    return true;
+}
+
+// Prints the page starting at log position cursor. If more entries remain,
+// ends with the position to resume from. Returns false if the response
+// filled first, with cursor and limit advanced past what was printed.
+bool PrintRequestsPage(RequestLog* log, ListPage* page, Response* out) {
+    // Position 0 of a page is the first command after the empty entry.
+    for (long position = page->cursor; position + 1 < log->count && position < page->end; position++) {
+        if (page->limit == 0) {
+            ResponsePrintf(out, "Next: %ld\n", position);
+            break;
         }
-        
-        current = current->next;
+        if (ResponseFull(out)) {
+            page->cursor = position;
+            return false;
+        }
+        ResponseAddString(out, log->commands[position + 1]);
+        ResponseAddBytes(out, "\n", 1);
+        page->limit--;
     }
+    return true;
 }
 
-void AddRule(char command[], Rule* head)
+// Prints matching rules starting at the first id not below cursor. If
+// another match follows the page, ends with its id as the cursor to resume
+// from, so rules added or deleted between pages are neither skipped nor
+// repeated. Returns false if the response filled first, as above.
+bool PrintRulesPage(RuleSet* set, ListPage* page, Response* out) {
+    for (long i = findRuleIndex(set, page->cursor); i < set->count && set->rules[i]->id < page->end; i++) {
+        Rule* current = set->rules[i];
+        if (!ruleMatchesPage(current, page)) {
+            continue;
+        }
+        if (page->limit == 0) {
+            ResponsePrintf(out, "Next: %ld\n", current->id);
+            break;
+        }
+        if (ResponseFull(out)) {
+            page->cursor = current->id;
+            return false;
+        }
+        PrintRule(current, out);
+        page->limit--;
+    }
+    return true;
+}
+
+void EndListing(Listing* listing) {
+    if (listing->active && listing->page.hasPortFilter) {
+        FreePortRange(&listing->page.portRange);
+    }
+    listing->active = false;
+}
+
+// Prints the next part of a listing, leaving it active if the response
+// filled before the listing was done.
+void ContinueListing(Listing* listing, RequestLog* requests, RuleSet* rules, Response* out) {
+    bool done = listing->isRules ? PrintRulesPage(rules, &listing->page, out)
+                                 : PrintRequestsPage(requests, &listing->page, out);
+    if (done) {
+        EndListing(listing);
+    }
+}
+
+// Starts an unfiltered listing of everything present now. Entries added
+// while it is being sent are left for the next listing.
+void StartFullListing(Listing* listing, bool isRules, long end) {
+    listing->active = true;
+    listing->isRules = isRules;
+    listing->page.cursor = 0;
+    listing->page.limit = LONG_MAX;
+    listing->page.end = end;
+    listing->page.hasIPFilter = false;
+    listing->page.hasPortFilter = false;
+}
+
+void FreeRule(Rule* rule);
+
+void AddRule(char command[], RuleSet* set, Response* out)
 {
     char* token = strtok(command, " \t");  
     char* ip_str = NULL;
@@ -304,7 +1281,7 @@ void AddRule(char command[], Rule* head)
 
     if (token != NULL) {
         if (token[0] != 'A' && token[0] != 'D') {
-            printf("Invalid rule\n");
+            ResponseAddString(out, "Invalid rule\n");
             return;
         }
         isAllow = (token[0] == 'A' || token[0] == 'a');
@@ -315,56 +1292,48 @@ void AddRule(char command[], Rule* head)
     }
 
     if (ip_str == NULL || port_str == NULL) {
-        printf("Invalid rule\n");
+        ResponseAddString(out, "Invalid rule\n");
         return;
     }
 
-    Rule* current = head;
-    while (current->next != NULL) {
-        current = current->next;
-    }
-
-    current->next = malloc(sizeof(Rule));
-    if (current->next == NULL) {
+    Rule* new_rule = malloc(sizeof(Rule));
+    if (new_rule == NULL) {
 
         return;
     }
 
-    Rule* new_rule = current->next;
-    new_rule->next = NULL;
+    memset(&new_rule->queries, 0, sizeof(QueryTable));
     new_rule->isAllow = isAllow;
 
     bool isValidIP = true;
     new_rule->ipRange = parseIPRange(ip_str, &isValidIP);
     if (!isValidIP) {
-        printf("Invalid rule\n");
+        ResponseAddString(out, "Invalid rule\n");
         free(new_rule);
-        current->next = NULL;
         return;
     }
 
     new_rule->portRange = parsePortRange(port_str);
     
     if (new_rule->portRange.isRange == -1 || new_rule->portRange.start > 65535 || new_rule->portRange.end > 65535) {
-        printf("Invalid rule\n");
+        ResponseAddString(out, "Invalid rule\n");
         free(new_rule);
-        current->next = NULL;
         return;
     }
 
     if (new_rule->portRange.isRange && 
         new_rule->portRange.end < new_rule->portRange.start) {
-        printf("Invalid rule\n");
+        ResponseAddString(out, "Invalid rule\n");
+        FreePortRange(&new_rule->portRange);
         free(new_rule);
-        current->next = NULL;
         return;
     }
 
-    if (isValidIP) {
-        printf("Rule added\n");
-    } else {
-        printf("Invalid rule\n");
+    if (!appendRule(set, new_rule)) {
+        FreeRule(new_rule);
+        return;
     }
+    ResponseAddString(out, "Rule added\n");
 }
 
 bool areIPRangesEqual(IPRange range1, IPRange range2) {
@@ -374,64 +1343,56 @@ bool areIPRangesEqual(IPRange range1, IPRange range2) {
            range1.isRange == range2.isRange;
 }
 
-bool arePortRangesEqual(PortRange range1, PortRange range2) {
-    if (range1.isRange) printf("-%d", range1.end);
-    if (range2.isRange) printf("-%d", range2.end);
+bool arePortRangesEqual(PortRange range1, PortRange range2, Response* out) {
+    if (range1.isRange) ResponsePrintf(out, "-%d", range1.end);
+    if (range2.isRange) ResponsePrintf(out, "-%d", range2.end);
     
     return range1.start == range2.start &&
            range1.end == range2.end &&
-           range1.isRange == range2.isRange;
+           range1.isRange == range2.isRange &&
+           range1.spanCount == range2.spanCount &&
+           (range1.spans == NULL) == (range2.spans == NULL) &&
+           (range1.spans == NULL ||
+            memcmp(range1.spans, range2.spans, range1.spanCount * sizeof(PortSpan)) == 0);
 }
 
-bool areRulesEqual(Rule* rule1, Rule* rule2) {
+bool areRulesEqual(Rule* rule1, Rule* rule2, Response* out) {
     if (!areIPRangesEqual(rule1->ipRange, rule2->ipRange)) {
         return false;
     }
-    if (!arePortRangesEqual(rule1->portRange, rule2->portRange)) {
+    if (!arePortRangesEqual(rule1->portRange, rule2->portRange, out)) {
         return false;
     }
     return true;
 }
 
-void deleteQueriesForRule(Query* queryHead, Rule* rule) {
-    Query* current = queryHead;
-    Query* prev = NULL;
-    
-    while (current != NULL) {
-        Query* next = current->next;
-        
-        if (current->matchedRule == rule) {
-            if (prev == NULL) {
-                queryHead = next;
-            } else {
-                prev->next = next;
-            }
-            free(current);
-        } else {
-            prev = current;
-        }
-        
-        current = next;
+void FreeRule(Rule* rule) {
+    if (rule == NULL) {
+        return;
     }
+    FreeQueries(&rule->queries);
+    FreePortRange(&rule->portRange);
+    free(rule);
 }
 
-bool deleteRule(Rule* head, Rule* ruleToDelete, Query* queryHead) {
-    if (head == NULL || head->next == NULL) return false;
+void FreeRuleSet(RuleSet* set) {
+    for (long i = 0; i < set->count; i++) {
+        FreeRule(set->rules[i]);
+    }
+    free(set->rules);
+}
 
-    Rule* current = head->next;
-    Rule* prev = head;
-    
-    while (current != NULL) {
+bool deleteRule(RuleSet* set, Rule* ruleToDelete, Response* out) {
+    if (ruleToDelete == NULL) return false;
 
-        if (areRulesEqual(current, ruleToDelete)) {
-            deleteQueriesForRule(queryHead, current);
-            
-            prev->next = current->next;
-            free(current);
+    for (long i = 0; i < set->count; i++) {
+        if (areRulesEqual(set->rules[i], ruleToDelete, out)) {
+            set->queryCount -= set->rules[i]->queries.live;
+            FreeRule(set->rules[i]);
+            memmove(&set->rules[i], &set->rules[i + 1], (set->count - i - 1) * sizeof(Rule*));
+            set->count--;
             return true;
         }
-        prev = current;
-        current = current->next;
     }
     return false;
 }
@@ -471,52 +1432,57 @@ Rule* parseRule(const char* ruleStr, bool* isValid) {
     
     while (*ruleStr && isspace(*ruleStr)) ruleStr++;
     
-    char port_str[256] = {0};
-    i = 0;
-    while (*ruleStr && !isspace(*ruleStr) && i < 255) {
-        port_str[i++] = *ruleStr++;
+    // Port lists have no length limit, so the token is copied to fit.
+    size_t portLen = 0;
+    while (ruleStr[portLen] && !isspace(ruleStr[portLen])) portLen++;
+    char* port_str = strndup(ruleStr, portLen);
+    if (port_str == NULL) {
+        *isValid = false;
+        free(rule);
+        return NULL;
     }
-    port_str[i] = '\0';
     
     rule->portRange = parsePortRange(port_str);
+    free(port_str);
     if (rule->portRange.isRange == -1 || rule->portRange.start > 65535 || rule->portRange.end > 65535) {
         *isValid = false;
         free(rule);
         return NULL;
     }
     
-    rule->next = NULL;
+    rule->id = 0;
+    memset(&rule->queries, 0, sizeof(QueryTable));
     return rule;
 }
 
 
 
-Rule* isConnectionAllowed(Rule* rules, IPAddress ip, unsigned short port) {
-    Rule* current = rules;
+Rule* isConnectionAllowed(RuleSet* rules, IPAddress ip, unsigned short port) {
     Rule* firstAllowRule = NULL;
     bool denyFound = false;
+    unsigned int now = currentTime();
 
-    if (current != NULL) {
-        current = current->next;
-    }
-
-    while (current != NULL) {
-        if (isIPInRange(ip, current->ipRange) && isPortInRange(port, current->portRange)) {
+    for (long i = 0; i < rules->count; i++) {
+        Rule* current = rules->rules[i];
+        if (isIPInRange(ip, current->ipRange) && isPortInRange(port, &current->portRange)) {
             if (current->isAllow) {
                 if (firstAllowRule == NULL) {
                     firstAllowRule = current;
                 }
-                if (!queryExists(current->queries, ip, port)) {
-                    AddQuery(current, ip, port);
+                Query* seen = findQuery(rules, &current->queries, ip, port, now);
+                if (seen == NULL) {
+                    AddQuery(rules, current, ip, port, now);
                     return firstAllowRule;
                 }
+                seen->hits++;
+                seen->lastSeen = now;
+                seen->referenced = 1;
             } else {
                 denyFound = true;
                 return NULL;
                 
             }
         }
-        current = current->next;
     }
 
     if (denyFound) {
@@ -526,22 +1492,37 @@ Rule* isConnectionAllowed(Rule* rules, IPAddress ip, unsigned short port) {
     return NULL;
 }
 
-void HandleRequest(char command[], Request* requests, Rule* rules, Query* queries)
+// Runs one command. L and R only start their listing here; the caller
+// continues it with ContinueListing while listing->active is set.
+void HandleRequest(char command[], RequestLog* requests, RuleSet* rules,
+                   Response* out, Listing* listing)
 {
     AddRequest(requests, command);
+    listing->active = false;
 
     if (command[0] == 'R') {
-        PrintRequests(requests);
+        if (command[1] == ' ') {
+            if (parseListPage(command + 2, &listing->page, false)) {
+                listing->active = true;
+                listing->isRules = false;
+            } else {
+                ResponseAddString(out, "Illegal request\n");
+            }
+        } else {
+            ResponseAddString(out, requests->commands[0]);
+            ResponseAddBytes(out, "\n", 1);
+            StartFullListing(listing, false, requests->count - 1);
+        }
     }
     else if (command[0] == 'A') {
-        AddRule(command, rules);
+        AddRule(command, rules, out);
     }
     else if (command[0] == 'C' && command[1] == ' ') {
         char ip_str[16];
         unsigned short port;
 
         if (sscanf(command + 2, "%15s %hu", ip_str, &port) != 2) {
-            printf("Illegal IP address or port specified\n");
+            ResponseAddString(out, "Illegal IP address or port specified\n");
             return;
         }
 
@@ -550,134 +1531,501 @@ void HandleRequest(char command[], Request* requests, Rule* rules, Query* querie
         if (isValidIPAddress(ip_str) && port <= 65535) {
             Rule* matchedRule = isConnectionAllowed(rules, ip, port);
             if (matchedRule != NULL) {
-                printf("Connection accepted\n");
+                ResponseAddString(out, "Connection accepted\n");
             } else {
-                printf("Connection rejected\n");
+                ResponseAddString(out, "Connection rejected\n");
                 
             }
         } else {
-            printf("Illegal IP address or port specified\n");
+            ResponseAddString(out, "Illegal IP address or port specified\n");
         }
     }
     else if (command[0] == 'D' && command[1] == ' ') {
         bool isValid = true;
-        char fullCommand[256];
-        snprintf(fullCommand, sizeof(fullCommand), "D %s", command + 2);
-        Rule* ruleToDelete = parseRule(fullCommand, &isValid);
+        Rule* ruleToDelete = parseRule(command, &isValid);
 
-        if (deleteRule(rules, ruleToDelete, queries)) {
-            printf("Rule deleted\n");
+        if (deleteRule(rules, ruleToDelete, out)) {
+            ResponseAddString(out, "Rule deleted\n");
         } else {
-            printf("Rule not found\n");
+            ResponseAddString(out, "Rule not found\n");
         }
 
-        if (deleteRule(rules, ruleToDelete, queries)) {
-            printf("Rule deleted\n");
+        if (deleteRule(rules, ruleToDelete, out)) {
+            ResponseAddString(out, "Rule deleted\n");
         } else {
-            printf("Rule not found\n");
+            ResponseAddString(out, "Rule not found\n");
         }
-        free(ruleToDelete);
+        FreeRule(ruleToDelete);
         return;
     }
     else if (command[0] == 'L') {
-        PrintRules(rules);
+        if (command[1] == ' ') {
+            if (parseListPage(command + 2, &listing->page, true)) {
+                listing->active = true;
+                listing->isRules = true;
+            } else {
+                ResponseAddString(out, "Illegal request\n");
+            }
+        } else {
+            StartFullListing(listing, true, rules->nextId);
+        }
     }
     else {
-        printf("Illegal request\n");
+        ResponseAddString(out, "Illegal request\n");
     }
 }
 
-void InteractiveMode()
-{
-    Request* requests = malloc(sizeof(Request));
-    Rule* rules = malloc(sizeof(Rule));
-    Query* queries = malloc(sizeof(Query));
+StateLock stateLock = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false, 0};
 
-    requests->next = NULL;
-    rules->next = NULL;
-    queries->next = NULL;
+ClientEntry clientTable[CLIENT_TABLE_SIZE];
+pthread_mutex_t clientLock = PTHREAD_MUTEX_INITIALIZER;
+int openConnections = 0;
 
-    char command[256];
-    char *fgets_result;
+void LockState(bool isMutation) {
+    pthread_mutex_lock(&stateLock.mutex);
+    if (isMutation) {
+        stateLock.waitingMutators++;
+        while (stateLock.held) {
+            pthread_cond_wait(&stateLock.released, &stateLock.mutex);
+        }
+        stateLock.waitingMutators--;
+    } else {
+        while (stateLock.held || stateLock.waitingMutators > 0) {
+            pthread_cond_wait(&stateLock.released, &stateLock.mutex);
+        }
+    }
+    stateLock.held = true;
+    pthread_mutex_unlock(&stateLock.mutex);
+}
 
-    while (1) {
-        fgets_result = fgets(command, sizeof(command), stdin);
-        
-        if (fgets_result == NULL) {
+void UnlockState() {
+    pthread_mutex_lock(&stateLock.mutex);
+    stateLock.held = false;
+    pthread_cond_broadcast(&stateLock.released);
+    pthread_mutex_unlock(&stateLock.mutex);
+}
+
+// Adds the tokens earned since the entry was last refilled, up to
+// COMMAND_BURST. Called with clientLock held.
+void refillClient(ClientEntry* entry, struct timespec now) {
+    double elapsed = (now.tv_sec - entry->refilled.tv_sec) +
+                     (now.tv_nsec - entry->refilled.tv_nsec) / 1e9;
+    entry->tokens += elapsed * COMMAND_RATE;
+    if (entry->tokens > COMMAND_BURST) {
+        entry->tokens = COMMAND_BURST;
+    }
+    entry->refilled = now;
+}
+
+// Finds the entry for exactly this address, claiming one if it has none.
+// An address's entry lives within CLIENT_PROBE_LIMIT slots of its hash, so
+// a lookup never scans further. A slot whose client is idle, with no open
+// connections and a full budget, can be handed to another address, since
+// a fresh entry would be identical. Returns NULL if every slot in the
+// window belongs to an active client. Called with clientLock held.
+ClientEntry* findClient(struct in_addr address) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // The high bits of the product depend on every bit of the address;
+    // the low bits would only see its low bits.
+    unsigned int home = (ntohl(address.s_addr) * 2654435761u) >> (32 - CLIENT_TABLE_BITS);
+    ClientEntry* reusable = NULL;
+
+    for (int i = 0; i < CLIENT_PROBE_LIMIT; i++) {
+        ClientEntry* entry = &clientTable[(home + i) % CLIENT_TABLE_SIZE];
+        if (!entry->used) {
+            if (reusable == NULL) {
+                reusable = entry;
+            }
+            continue;
+        }
+        refillClient(entry, now);
+        if (entry->address.s_addr == address.s_addr) {
+            return entry;
+        }
+        if (reusable == NULL && entry->connections == 0 && entry->tokens >= COMMAND_BURST) {
+            reusable = entry;
+        }
+    }
+
+    if (reusable != NULL) {
+        reusable->address = address;
+        reusable->tokens = COMMAND_BURST;
+        reusable->refilled = now;
+        reusable->connections = 0;
+        reusable->used = true;
+    }
+    return reusable;
+}
+
+// Takes one command token from address's bucket. Returns false if the
+// bucket is empty or the address could not be given an entry.
+bool takeCommandToken(struct in_addr address) {
+    pthread_mutex_lock(&clientLock);
+    ClientEntry* entry = findClient(address);
+    bool allowed = entry != NULL && entry->tokens >= 1.0;
+    if (allowed) {
+        entry->tokens -= 1.0;
+    }
+    pthread_mutex_unlock(&clientLock);
+    return allowed;
+}
+
+// Counts a new connection from address. Returns false if the server
+// already has MAX_CONNECTIONS open or the address has
+// MAX_CONNECTIONS_PER_CLIENT, a small share of the total, so a few
+// addresses holding idle connections cannot use up every thread.
+bool openClientConnection(struct in_addr address) {
+    pthread_mutex_lock(&clientLock);
+    ClientEntry* entry = NULL;
+    if (openConnections < MAX_CONNECTIONS) {
+        entry = findClient(address);
+    }
+    bool allowed = entry != NULL && entry->connections < MAX_CONNECTIONS_PER_CLIENT;
+    if (allowed) {
+        entry->connections++;
+        openConnections++;
+    }
+    pthread_mutex_unlock(&clientLock);
+    return allowed;
+}
+
+void closeClientConnection(struct in_addr address) {
+    pthread_mutex_lock(&clientLock);
+    ClientEntry* entry = findClient(address);
+    if (entry != NULL && entry->connections > 0) {
+        entry->connections--;
+    }
+    openConnections--;
+    pthread_mutex_unlock(&clientLock);
+}
+
+// Runs every complete line in data[0..len) through HandleRequest. Lines are
+// copied into a reusable buffer because HandleRequest tokenises in place.
+// Returns the number of bytes consumed; a trailing partial line is left
+// unconsumed unless atEOF is set. When client is given, each command is
+// charged against that address's token bucket.
+size_t ProcessCommandBuffer(const char* data, size_t len, bool atEOF,
+                            char** line, size_t* lineCap, bool* quit,
+                            RequestLog* requests, RuleSet* rules, Response* out,
+                            const struct in_addr* client)
+{
+    size_t pos = 0;
+
+    while (pos < len && !*quit) {
+        const char* newline = memchr(data + pos, '\n', len - pos);
+        size_t lineLen;
+        size_t next;
+
+        if (newline != NULL) {
+            lineLen = newline - (data + pos);
+            next = pos + lineLen + 1;
+        } else if (atEOF) {
+            lineLen = len - pos;
+            next = len;
+        } else {
             break;
         }
 
-        command[strcspn(command, "\n")] = 0;
+        if (lineLen + 1 > *lineCap) {
+            char* grown = realloc(*line, lineLen + 1);
+            if (grown == NULL) {
+                *quit = true;
+                break;
+            }
+            *line = grown;
+            *lineCap = lineLen + 1;
+        }
+        memcpy(*line, data + pos, lineLen);
+        (*line)[lineLen] = '\0';
+        pos = next;
 
-        if (command[0] == 'Q') {
+        if ((*line)[0] == 'Q') {
+            *quit = true;
             break;
         }
 
-        if (strlen(command) > 0) {
-            HandleRequest(command, requests, rules, queries);
-            fflush(stdout);
+        if (strlen(*line) > 0) {
+            if (client != NULL && !takeCommandToken(*client)) {
+                ResponseAddString(out, "Too many requests\n");
+                continue;
+            }
+            Listing listing;
+            LockState((*line)[0] == 'A' || (*line)[0] == 'D');
+            HandleRequest(*line, requests, rules, out, &listing);
+            if (listing.active) {
+                ContinueListing(&listing, requests, rules, out);
+            }
+            UnlockState();
+
+            // Output is only written with the lock released, so a client
+            // that stops reading stalls nobody else. Long listings are sent
+            // a part at a time, retaking the lock for each part.
+            while (listing.active) {
+                if (!FlushResponse(out)) {
+                    EndListing(&listing);
+                    break;
+                }
+                LockState(false);
+                ContinueListing(&listing, requests, rules, out);
+                UnlockState();
+            }
+            if (ResponseFull(out)) {
+                FlushResponse(out);
+            }
         }
     }
 
-    free(requests);
-    free(rules);
-    free(queries);
+    return pos;
 }
 
-void* handle_client(void* arg) {
-    ThreadArgs* args = (ThreadArgs*)arg;
-    int new_socket = args->socket;
-    char buffer[1024] = {0};
-    char response[1024] = {0};
+// Maps stdin when it is a regular file so the whole batch is parsed without
+// any further reads. Returns false if stdin cannot be mapped.
+bool ProcessMappedInput(char** line, size_t* lineCap, bool* quit,
+                        RequestLog* requests, RuleSet* rules, Response* out)
+{
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
 
-    while(1) {
+    off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+    if (offset < 0 || offset > st.st_size) {
+        return false;
+    }
+    if (offset == st.st_size) {
+        return true;
+    }
 
-        memset(buffer, 0, sizeof(buffer));
-        memset(response, 0, sizeof(response));
-        
-        int valread = read(new_socket, buffer, 1024);
-        if (valread <= 0) {
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    size_t consumed = ProcessCommandBuffer(data + offset, st.st_size - offset, true,
+                                           line, lineCap, quit, requests, rules, out, NULL);
+    lseek(STDIN_FILENO, offset + consumed, SEEK_SET);
+    munmap(data, st.st_size);
+    return true;
+}
+
+// Reads stdin in large chunks, handling every complete line in a chunk
+// before output is flushed and the next read is issued.
+void ProcessStreamedInput(char** line, size_t* lineCap, bool* quit,
+                          RequestLog* requests, RuleSet* rules, Response* out)
+{
+    size_t cap = INPUT_CHUNK_SIZE;
+    size_t len = 0;
+    char* data = malloc(cap);
+    if (data == NULL) {
+        return;
+    }
+
+    while (!*quit) {
+        if (len == cap) {
+            char* grown = realloc(data, cap * 2);
+            if (grown == NULL) {
+                break;
+            }
+            data = grown;
+            cap *= 2;
+        }
+
+        ssize_t n = read(STDIN_FILENO, data + len, cap - len);
+        if (n < 0) {
+            break;
+        }
+
+        bool atEOF = (n == 0);
+        len += n;
+
+        size_t consumed = ProcessCommandBuffer(data, len, atEOF,
+                                               line, lineCap, quit, requests, rules, out, NULL);
+        memmove(data, data + consumed, len - consumed);
+        len -= consumed;
+
+        if (!FlushResponse(out)) {
             break;
         }
 
-        buffer[strcspn(buffer, "\n")] = 0;
+        if (atEOF) {
+            break;
+        }
+    }
+
+    free(data);
+}
+
+void InteractiveMode()
+{
+    RequestLog requests;
+    RuleSet rules;
+
+    InitRequestLog(&requests);
+    InitRuleSet(&rules);
+
+    Response out;
+    InitResponse(&out, STDOUT_FILENO);
+
+    char* line = NULL;
+    size_t lineCap = 0;
+    bool quit = false;
+
+    if (!ProcessMappedInput(&line, &lineCap, &quit, &requests, &rules, &out)) {
+        ProcessStreamedInput(&line, &lineCap, &quit, &requests, &rules, &out);
+    }
+    FlushResponse(&out);
+
+    FreeResponse(&out);
+    free(line);
+    FreeRequestLog(&requests);
+    FreeRuleSet(&rules);
+}
+
+void ServeClient(int socket, struct in_addr address, ThreadArgs* args) {
+    size_t cap = INPUT_CHUNK_SIZE;
+    size_t len = 0;
+    char* buffer = malloc(cap);
+    char* line = NULL;
+    size_t lineCap = 0;
+    bool quit = false;
+
+    // Idle or stalled clients are dropped so they cannot hold a connection
+    // slot indefinitely.
+    struct timeval timeout = {CLIENT_TIMEOUT_SECONDS, 0};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    Response out;
+    InitResponse(&out, socket);
+
+    while (buffer != NULL && !quit) {
+        if (len == cap) {
+            char* grown = cap < MAX_CLIENT_LINE ? realloc(buffer, cap * 2) : NULL;
+            if (grown == NULL) {
+                break;
+            }
+            buffer = grown;
+            cap *= 2;
+        }
+
+        // A command may arrive split across reads, so a trailing partial
+        // line is kept until the rest of it arrives. An unterminated line is
+        // run once the client half-closes, or once nothing more has arrived
+        // for PARTIAL_LINE_WAIT_MS, so a client that sends a single command
+        // without a newline and waits for the reply is still answered.
+        bool idleTail = false;
+        if (len > 0) {
+            struct pollfd pending = {.fd = socket, .events = POLLIN};
+            idleTail = (poll(&pending, 1, PARTIAL_LINE_WAIT_MS) == 0);
+        }
+
+        ssize_t valread = 0;
+        if (!idleTail) {
+            valread = read(socket, buffer + len, cap - len);
+            if (valread < 0) {
+                break;
+            }
+        }
+
+        bool atEOF = (valread == 0 && !idleTail);
+        len += valread;
+
+        size_t consumed = ProcessCommandBuffer(buffer, len, atEOF || idleTail,
+                                               &line, &lineCap, &quit,
+                                               args->requests, args->rules,
+                                               &out, &address);
+        memmove(buffer, buffer + consumed, len - consumed);
+        len -= consumed;
 
-        if (strcmp(buffer, "Q") == 0) {
+        if (!FlushResponse(&out) || atEOF) {
             break;
         }
+    }
 
-        FILE *temp = tmpfile();
-        FILE *old_stdout = stdout;
-        stdout = temp;
+    FreeResponse(&out);
+    free(line);
+    free(buffer);
+    close(socket);
+    closeClientConnection(address);
+}
 
-        HandleRequest(buffer, args->requests, args->rules, args->queries);
+void* handle_client(void* arg) {
+    ThreadArgs* args = (ThreadArgs*)arg;
+    ServeClient(args->socket, args->address, args);
+    free(args);
+    return NULL;
+}
 
-        fflush(stdout);
-        stdout = old_stdout;
-        rewind(temp);
-        fread(response, sizeof(char), sizeof(response)-1, temp);
-        fclose(temp);
+// Ages out the query history a few rules at a time, so the state lock is
+// never held for a full pass over a large rule list.
+void* reap_queries(void* arg) {
+    ThreadArgs* args = (ThreadArgs*)arg;
+    long cursor = 0;
 
-        send(new_socket, response, strlen(response), 0);
+    while (1) {
+        sleep(QUERY_REAP_INTERVAL_SECONDS);
+        LockState(false);
+        cursor = ReapQueries(args->rules, cursor, QUERY_REAP_BATCH, currentTime());
+        UnlockState();
     }
 
-    close(new_socket);
-    free(arg);
     return NULL;
 }
 
+void rejectClient(int socket) {
+    static const char busy[] = "Server busy\n";
+    send(socket, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(socket);
+}
+
+// Starts a thread for a new connection, or turns it away at once if the
+// server or its address already has too many connections open.
+void admitClient(int socket, struct in_addr address, RequestLog* requests, RuleSet* rules) {
+    if (!openClientConnection(address)) {
+        rejectClient(socket);
+        return;
+    }
+
+    ThreadArgs* args = malloc(sizeof(ThreadArgs));
+    if (args == NULL) {
+        rejectClient(socket);
+        closeClientConnection(address);
+        return;
+    }
+    args->socket = socket;
+    args->address = address;
+    args->requests = requests;
+    args->rules = rules;
+
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, handle_client, (void*)args) != 0) {
+        free(args);
+        rejectClient(socket);
+        closeClientConnection(address);
+    } else {
+        pthread_detach(thread_id);
+    }
+}
+
 void ServerMode(int port) {
     int server_fd, new_socket;
     struct sockaddr_in address;
     int addrlen = sizeof(address);
-    Request* requests = malloc(sizeof(Request));
-    Rule* rules = malloc(sizeof(Rule));
-    Query* queries = malloc(sizeof(Query));
+    RequestLog requests;
+    RuleSet rules;
+
+    InitRequestLog(&requests);
+    InitRuleSet(&rules);
 
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
         exit(EXIT_FAILURE);
     }
 
+    signal(SIGPIPE, SIG_IGN);
+
     int opt = 1;
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt))) {
         exit(EXIT_FAILURE);
@@ -692,38 +2040,38 @@ void ServerMode(int port) {
     }
 
 
-    if (listen(server_fd, 3) < 0) {
+    if (listen(server_fd, LISTEN_BACKLOG) < 0) {
         exit(EXIT_FAILURE);
     }
 
+    ThreadArgs args;
+    args.socket = -1;
+    args.requests = &requests;
+    args.rules = &rules;
+
+    if (QUERY_TTL_SECONDS > 0) {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, reap_queries, (void*)&args) != 0) {
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread_id);
+    }
 
     while(1) {
         if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
             continue;
         }
 
-        ThreadArgs* args = malloc(sizeof(ThreadArgs));
-        args->socket = new_socket;
-        args->requests = requests;
-        args->rules = rules;
-        args->queries = queries;
-
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, (void*)args) != 0) {
-            free(args);
-            close(new_socket);
-        } else {
-            pthread_detach(thread_id);
-        }
+        admitClient(new_socket, address.sin_addr, &requests, &rules);
     }
 
     close(server_fd);
-    free(requests);
-    free(rules);
-    free(queries);
+    FreeRequestLog(&requests);
+    FreeRuleSet(&rules);
 }
 
 
+#ifndef SERVER_NO_MAIN
 int main (int argc, char ** argv) {
 
 
@@ -741,3 +2089,4 @@ int main (int argc, char ** argv) {
 
     return 0;
 }
+#endif
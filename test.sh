@@ -81,6 +81,37 @@ function interactive_testcase() {
     fi
 }
 
+function test_long_input_lines() {
+    echo "Running long input line test"
+    rm -f $serverOut $successFile
+    inputFile=testInput.txt
+
+    printf 'A 10.3.0.0/16 22\n%s\nC 10.3.0.1 22\nL\n' "$(printf 'X%.0s' {1..300})" > $inputFile
+    printf 'Rule added\nIllegal request\nConnection accepted\nRule: 10.3.0.0-10.3.255.255 22\nQuery: 10.3.0.1 22\n' > $successFile
+
+    echo -en "Testing redirected input: \t"
+    $server -i < $inputFile > $serverOut 2>&1
+    if diff $serverOut $successFile >/dev/null 2>&1; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $(cat $serverOut))"
+        rm -f $inputFile
+        return 1
+    fi
+
+    echo -en "Testing piped input: \t"
+    result=$(cat $inputFile | $server -i 2>&1)
+    rm -f $inputFile
+    if [ "$result" == "$(cat $serverOut)" ]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    return 0
+}
+
 function basic_testcase(){
     echo "Running basic testcase"
     rm -f $clientOut $successFile
@@ -125,6 +156,24 @@ function test_invalid_inputs() {
         return 1
     fi
     
+    echo -en "Testing trailing junk after IP: \t"
+    result=$($client $IPADDRESS $PORT "A 192.168.1.1x 80")
+    if [[ "$result" == *"Invalid rule"* ]]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    echo -en "Testing trailing junk after port: \t"
+    result=$($client $IPADDRESS $PORT "A 192.168.1.1 80abc")
+    if [[ "$result" == *"Invalid rule"* ]]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+    
     echo -en "Testing invalid command: \t"
     result=$($client $IPADDRESS $PORT "X")
     if [[ "$result" == *"Illegal request"* ]]; then
@@ -278,10 +327,294 @@ function test_concurrent_connections() {
     return 0
 }
 
+function test_large_listing() {
+    echo "Running large listing test"
+
+    for i in {1..100}; do
+        $client $IPADDRESS $PORT "A 10.1.1.$i 1000-2000" > /dev/null
+    done
+
+    echo -en "Testing listing over 1 KiB: \t"
+    count=$($client $IPADDRESS $PORT "L" | grep -c "^Rule: 10.1.1")
+    if [ "$count" -eq 100 ]; then
+        echo "OK"
+    else
+        echo "FAILED (Got $count rules)"
+        return 1
+    fi
+
+    echo -en "Testing pipelined commands: \t"
+    result=$($client $IPADDRESS $PORT "$(printf 'C 10.1.1.1 1500\nC 10.1.1.1 80')")
+    if [ "$result" == "$(printf 'Connection accepted\nConnection rejected')" ]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    return 0
+}
+
+function test_split_command() {
+    echo "Running split command test"
+
+    echo -en "Testing command split across writes: \t"
+    exec 3<>/dev/tcp/$IPADDRESS/$PORT
+    printf 'A 10.9.9.9 2' >&3
+    sleep 0.2
+    printf '2\n' >&3
+    read -t 5 -u 3 result
+    exec 3>&-
+    if [ "$result" == "Rule added" ]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    echo -en "Testing split command added one rule: \t"
+    result=$($client $IPADDRESS $PORT "C 10.9.9.9 22")
+    if [[ "$result" == *"Connection accepted"* ]]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    echo -en "Testing unterminated command without half-close: \t"
+    exec 3<>/dev/tcp/$IPADDRESS/$PORT
+    printf 'C 10.9.9.8 22' >&3
+    read -t 5 -u 3 result
+    exec 3>&-
+    if [ "$result" == "Connection rejected" ]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    return 0
+}
+
+function test_paginated_listing() {
+    echo "Running paginated listing test"
+
+    echo -en "Testing listing page: \t"
+    result=$($client $IPADDRESS $PORT "L 0 1 10.1.1.5")
+    if [ "$result" == "Rule: 10.1.1.5 1000-2000" ]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    echo -en "Testing listing cursor: \t"
+    result=$($client $IPADDRESS $PORT "L 0 2 10.1.1.0-10.1.1.255 1500" | tail -n 1)
+    if [[ "$result" == "Next: "* ]]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    return 0
+}
+
+function test_listing_cursor_after_delete() {
+    echo "Running listing cursor stability test"
+
+    for i in 1 2 3; do
+        $client $IPADDRESS $PORT "A 10.30.0.$i 1" > /dev/null
+    done
+
+    next=$($client $IPADDRESS $PORT "L 0 1 10.30.0.0/24" | sed -n 's/^Next: //p')
+    $client $IPADDRESS $PORT "D 10.30.0.1 1" > /dev/null
+
+    echo -en "Testing page after earlier rule deleted: \t"
+    result=$($client $IPADDRESS $PORT "L $next 1 10.30.0.0/24" | head -n 1)
+    if [ "$result" == "Rule: 10.30.0.2 1" ]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    return 0
+}
+
+function test_cidr_rules() {
+    echo "Running CIDR and port list rules test"
+
+    $client $IPADDRESS $PORT "A 10.20.0.0/16 22,8080" > /dev/null
+
+    echo -en "Testing connection within CIDR block: \t"
+    result=$($client $IPADDRESS $PORT "C 10.20.7.9 8080")
+    if [[ "$result" == *"Connection accepted"* ]]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    echo -en "Testing port outside port list: \t"
+    result=$($client $IPADDRESS $PORT "C 10.20.7.9 80")
+    if [[ "$result" == *"Connection rejected"* ]]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    echo -en "Testing long port list: \t"
+    $client $IPADDRESS $PORT "A 10.21.0.0/16 $(seq -s, 1001 2 1061)" > /dev/null
+    result=$($client $IPADDRESS $PORT "C 10.21.0.1 1061")
+    if [[ "$result" == *"Connection accepted"* ]]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    echo -en "Testing listing filtered by port list: \t"
+    result=$($client $IPADDRESS $PORT "L 0 10 10.20.0.0/16 80")
+    if [ -z "$result" ]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    return 0
+}
+
+function test_differential() {
+    echo "Running differential matcher test"
+    ./difftest 1 200
+}
+
+function test_connection_limit() {
+    echo "Running per-client connection limit test"
+
+    fds=()
+    for i in {1..8}; do
+        exec {fd}<>/dev/tcp/$IPADDRESS/$PORT
+        fds+=($fd)
+    done
+    sleep 0.2
+
+    echo -en "Testing connection over the limit: \t"
+    result=$($client $IPADDRESS $PORT "C 10.20.7.11 8080")
+    for fd in "${fds[@]}"; do
+        exec {fd}>&-
+    done
+    if [[ "$result" != *"Server busy"* ]]; then
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+    echo "OK"
+
+    sleep 0.5
+    echo -en "Testing connection after others closed: \t"
+    result=$($client $IPADDRESS $PORT "C 10.20.7.10 8080")
+    if [[ "$result" == *"Connection accepted"* ]]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    return 0
+}
+
+function test_idle_connections() {
+    echo "Running idle connection test"
+
+    # Two other addresses each hold their full share of idle connections.
+    perl -MIO::Socket::INET -e '
+        my ($port, @sources) = @ARGV;
+        my @sockets;
+        for my $source (@sources) {
+            for (1..8) {
+                push @sockets, IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port",
+                                                     LocalAddr => $source) or die;
+            }
+        }
+        sleep 10;' $PORT 127.0.0.2 127.0.0.3 &
+    holder=$!
+    sleep 0.5
+
+    echo -en "Testing command alongside idle connections: \t"
+    result=$(timeout 5 $client $IPADDRESS $PORT "C 10.20.7.12 8080")
+    kill $holder
+    wait $holder 2>/dev/null
+    if [[ "$result" == *"Connection accepted"* ]]; then
+        echo "OK"
+    else
+        echo "FAILED (Got: $result)"
+        return 1
+    fi
+
+    return 0
+}
+
+function test_query_retention() {
+    echo "Running query retention test"
+    rm -f $serverOut $successFile
+    retentionServer=./retention-server
+
+    (printf 'A 10.40.0.0/16 80\nC 10.40.0.1 80\nC 10.40.0.2 80\nC 10.40.0.3 80\nC 10.40.0.1 80\nC 10.40.0.3 80\nL\n'
+     sleep 2
+     printf 'C 10.40.0.3 80\nL\n') | $retentionServer -i > $serverOut 2>&1
+    printf '%s\n' "Rule added" "Connection accepted" "Connection accepted" "Connection accepted" \
+        "Connection accepted" "Connection rejected" \
+        "Rule: 10.40.0.0-10.40.255.255 80" "Query: 10.40.0.1 80" "Query: 10.40.0.3 80 hits 2" \
+        "Connection accepted" \
+        "Rule: 10.40.0.0-10.40.255.255 80" "Query: 10.40.0.3 80" > $successFile
+
+    echo -en "Testing eviction, hits and expiry: \t"
+    if diff $serverOut $successFile >/dev/null 2>&1; then
+        echo "OK"
+    else
+        echo "FAILED"
+        diff $successFile $serverOut
+        return 1
+    fi
+
+    echo -en "Testing global record budget: \t"
+    count=$(printf 'A 10.41.0.0/16 80\nA 10.42.0.0/16 80\nC 10.41.0.1 80\nC 10.41.0.2 80\nC 10.42.0.1 80\nC 10.42.0.2 80\nL\n' \
+        | $retentionServer -i | grep -c "^Query:")
+    if [ "$count" -eq 3 ]; then
+        echo "OK"
+    else
+        echo "FAILED (Got $count records)"
+        return 1
+    fi
+
+    return 0
+}
+
+function test_rate_limit() {
+    echo "Running rate limit test"
+
+    commands=$(for i in {1..500}; do echo "L 0 1"; done)
+
+    echo -en "Testing command burst is limited: \t"
+    count=$($client $IPADDRESS $PORT "$commands" | grep -c "Too many requests")
+    if [ "$count" -gt 0 ]; then
+        echo "OK"
+    else
+        echo "FAILED (No commands were limited)"
+        return 1
+    fi
+
+    return 0
+}
+
 # --- execution ---
 start_server || exit 1
 
 run interactive_testcase
+run test_long_input_lines
 run basic_testcase
 run test_invalid_inputs
 run test_rule_operations
@@ -289,6 +622,16 @@ run test_connection_checking
 run test_ip_range_rules
 run test_port_range_rules
 run test_concurrent_connections
+run test_large_listing
+run test_split_command
+run test_paginated_listing
+run test_listing_cursor_after_delete
+run test_cidr_rules
+run test_differential
+run test_query_retention
+run test_connection_limit
+run test_idle_connections
+run test_rate_limit
 
 stop_server
 